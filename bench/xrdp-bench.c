@@ -0,0 +1,948 @@
+/***
+  benchmark of the xrdp sink and source transport against a mock chansrv
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/*
+ * The mock chansrv runs in its own thread and accepts any number of sink
+ * and source connections on two unix sockets. Sink connections are read
+ * like chansrv reads them, every data frame carries its send time in the
+ * first 8 bytes so the receive side gives the end-to-end latency. Source
+ * connections answer every READ command with the requested bytes and the
+ * driver times the round trip.
+ *
+ * The driver plays 'sessions' modules, each sending one block per block
+ * time with xrdp_send_frames() like module-xrdp-sink.c, or polling like
+ * module-xrdp-source.c. They share one thread, or with -T each gets its
+ * own like the IO thread of a PulseAudio per session, which is what the
+ * context switch and wakeup counts of xrdp-loadtest.sh are about.
+ *
+ * With -R the driver replays a capture_file= from either module instead
+ * of sending a block per block time: every session sends the recorded
+ * sink frames and source READs at their recorded times, and the source
+ * round trips are reported next to the recorded ones.
+ */
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* ppoll() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/sample.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-transport.h"
+#include "xrdp-capture.h"
+
+/* must match module-xrdp-sink.c and module-xrdp-source.c */
+#define XRDP_SINK_CODE_DATA 0
+#define XRDP_SINK_CODE_SHM_SETUP 2
+#define XRDP_SINK_CODE_SHM_DATA 3
+#define XRDP_SOURCE_CMD_READ 3
+#define XRDP_SOURCE_CMD_BYTES 11
+
+#define MAX_SESSIONS 1024
+#define SEND_RING_BYTES (256 * 1024)
+#define RECV_BUF_BYTES (64 * 1024 + sizeof(struct xrdp_header))
+/* time to get all session threads going before the first block */
+#define DRIVER_START_USEC (100 * PA_USEC_PER_MSEC)
+
+/* end-to-end latency or round trip samples in usec */
+struct samples {
+    uint64_t *v;
+    size_t n;
+    size_t size;
+};
+
+struct mock_client {
+    int fd;
+    int is_sink;
+    char *buf;
+    size_t len;
+};
+
+struct mock {
+    int sink_listen;
+    int source_listen;
+    int wake[2]; /* written to stop the thread */
+    struct mock_client clients[2 * MAX_SESSIONS];
+    int nclients;
+    char *source_data;
+
+    /* results, read after the thread is joined */
+    struct samples latency;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t wakeups;
+};
+
+struct session {
+    int sink_fd;
+    int source_fd;
+    struct xrdp_send_ring ring;
+    struct xrdp_transport_stats stats;
+    pa_usec_t next;
+    pa_usec_t base; /* -R: when the capture starts for this session */
+    size_t replay_off; /* -R: next record */
+};
+
+/* a mapped capture for -R */
+struct replay {
+    char *map;
+    size_t size;
+    struct xrdp_capture_header h;
+    pa_usec_t duration;
+    size_t max_frame; /* largest sink frame payload */
+    uint64_t records;
+    struct samples rtt; /* READ to reply in the capture */
+};
+
+struct options {
+    int sink;
+    int source;
+    pa_sample_spec ss;
+    int sessions;
+    int seconds;
+    pa_usec_t block_usec;
+    double speed; /* blocks go out this much faster than real time */
+    int threaded; /* a thread per session, like one PulseAudio each */
+    const char *replay; /* -R capture file */
+};
+
+static void samples_add(struct samples *s, uint64_t v) {
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 4096;
+        s->v = pa_xrealloc(s->v, s->size * sizeof(*s->v));
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void samples_report(const char *what, struct samples *s) {
+    if (s->n == 0) {
+        printf("%s_usec none\n", what);
+        return;
+    }
+    qsort(s->v, s->n, sizeof(*s->v), cmp_u64);
+    printf("%s_usec p50 %llu p99 %llu p999 %llu max %llu\n", what,
+           (unsigned long long) s->v[s->n / 2],
+           (unsigned long long) s->v[s->n * 99 / 100],
+           (unsigned long long) s->v[s->n * 999 / 1000],
+           (unsigned long long) s->v[s->n - 1]);
+}
+
+static pa_usec_t thread_cpu_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (pa_usec_t) ts.tv_sec * PA_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un s;
+    int fd;
+
+    memset(&s, 0, sizeof(s));
+    s.sun_family = AF_UNIX;
+    pa_strlcpy(s.sun_path, path, sizeof(s.sun_path));
+    unlink(path);
+    if ((fd = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr *) &s, sizeof(s)) != 0 ||
+        listen(fd, MAX_SESSIONS) != 0) {
+        fprintf(stderr, "can't listen on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un s;
+    int fd;
+
+    memset(&s, 0, sizeof(s));
+    s.sun_family = AF_UNIX;
+    pa_strlcpy(s.sun_path, path, sizeof(s.sun_path));
+    if ((fd = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *) &s, sizeof(s)) != 0) {
+        fprintf(stderr, "can't connect to %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+static void mock_accept(struct mock *m, int listen_fd, int is_sink) {
+    struct mock_client *c;
+    int fd;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+        return;
+    }
+    if ((size_t) m->nclients == PA_ELEMENTSOF(m->clients)) {
+        close(fd);
+        return;
+    }
+    c = &m->clients[m->nclients++];
+    c->fd = fd;
+    c->is_sink = is_sink;
+    c->buf = pa_xmalloc(RECV_BUF_BYTES);
+    c->len = 0;
+}
+
+/* chansrv side of the sink socket, returns -1 once the client is gone */
+static int mock_read_sink(struct mock *m, struct mock_client *c) {
+    struct xrdp_header h;
+    uint64_t sent;
+    ssize_t got;
+    size_t off;
+
+    got = recv(c->fd, c->buf + c->len, RECV_BUF_BYTES - c->len, 0);
+    if (got <= 0) {
+        return -1;
+    }
+    c->len += got;
+
+    off = 0;
+    while (c->len - off >= sizeof(h)) {
+        memcpy(&h, c->buf + off, sizeof(h));
+        if (h.bytes < (int) sizeof(h) || (size_t) h.bytes > RECV_BUF_BYTES) {
+            fprintf(stderr, "mock chansrv: bad frame, %d bytes\n", h.bytes);
+            return -1;
+        }
+        if (c->len - off < (size_t) h.bytes) {
+            break;
+        }
+        if (h.code == XRDP_SINK_CODE_DATA &&
+            (size_t) h.bytes >= sizeof(h) + sizeof(sent)) {
+            memcpy(&sent, c->buf + off + sizeof(h), sizeof(sent));
+            samples_add(&m->latency, pa_rtclock_now() - sent);
+        }
+        m->bytes += h.bytes - sizeof(h);
+        m->frames++;
+        off += h.bytes;
+    }
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+    return 0;
+}
+
+/* chansrv side of the source socket: answer READ with the bytes asked for */
+static int mock_read_source(struct mock *m, struct mock_client *c) {
+    unsigned char *cmd;
+    unsigned char len[2];
+    ssize_t got;
+    size_t off;
+    int bytes;
+
+    got = recv(c->fd, c->buf + c->len, RECV_BUF_BYTES - c->len, 0);
+    if (got <= 0) {
+        return -1;
+    }
+    c->len += got;
+
+    off = 0;
+    while (c->len - off >= XRDP_SOURCE_CMD_BYTES) {
+        cmd = (unsigned char *) c->buf + off;
+        off += XRDP_SOURCE_CMD_BYTES;
+        if (cmd[8] != XRDP_SOURCE_CMD_READ) {
+            continue;
+        }
+        bytes = MIN(cmd[9] | (cmd[10] << 8), 0xffff);
+        len[0] = bytes & 0xff;
+        len[1] = (bytes >> 8) & 0xff;
+        if (xrdp_lsend(c->fd, (char *) len, 2) != 2 ||
+            xrdp_lsend(c->fd, m->source_data, bytes) != bytes) {
+            return -1;
+        }
+        m->bytes += bytes;
+        m->frames++;
+    }
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+    return 0;
+}
+
+static void *mock_thread(void *userdata) {
+    struct mock *m = userdata;
+    struct pollfd fds[3 + PA_ELEMENTSOF(m->clients)];
+    int nfds;
+    int i;
+    int rv;
+
+    for (;;) {
+        fds[0].fd = m->wake[0];
+        fds[1].fd = m->sink_listen;
+        fds[2].fd = m->source_listen;
+        for (i = 0; i < m->nclients; i++) {
+            fds[3 + i].fd = m->clients[i].fd;
+        }
+        nfds = 3 + m->nclients;
+        for (i = 0; i < nfds; i++) {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        m->wakeups++;
+
+        if (fds[0].revents) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            mock_accept(m, m->sink_listen, 1);
+        }
+        if (fds[2].revents & POLLIN) {
+            mock_accept(m, m->source_listen, 0);
+        }
+        for (i = nfds - 1; i >= 3; i--) {
+            struct mock_client *c = &m->clients[i - 3];
+
+            if (!fds[i].revents) {
+                continue;
+            }
+            rv = c->is_sink ? mock_read_sink(m, c) : mock_read_source(m, c);
+            if (rv != 0) {
+                close(c->fd);
+                pa_xfree(c->buf);
+                *c = m->clients[--m->nclients];
+            }
+        }
+    }
+
+    for (i = 0; i < m->nclients; i++) {
+        close(m->clients[i].fd);
+        pa_xfree(m->clients[i].buf);
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m sink|source|both  what to drive (both)\n"
+            "  -f format            sample format (s16le)\n"
+            "  -r rate              sample rate (44100)\n"
+            "  -c channels          channels (2)\n"
+            "  -n sessions          concurrent sessions (1)\n"
+            "  -t seconds           run time (10)\n"
+            "  -l msec              block time (10)\n"
+            "  -x factor            send this much faster than real time (1)\n"
+            "  -T                   one IO thread per session\n"
+            "  -R file              replay a capture_file= instead, -x still applies\n",
+            name);
+}
+
+static int parse_options(struct options *o, int argc, char **argv) {
+    int opt;
+
+    o->sink = 1;
+    o->source = 1;
+    o->ss.format = PA_SAMPLE_S16LE;
+    o->ss.rate = 44100;
+    o->ss.channels = 2;
+    o->sessions = 1;
+    o->seconds = 10;
+    o->block_usec = 10 * PA_USEC_PER_MSEC;
+    o->speed = 1.0;
+    o->threaded = 0;
+    o->replay = NULL;
+
+    while ((opt = getopt(argc, argv, "m:f:r:c:n:t:l:x:TR:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                o->sink = strcmp(optarg, "source") != 0;
+                o->source = strcmp(optarg, "sink") != 0;
+                break;
+            case 'f':
+                o->ss.format = pa_parse_sample_format(optarg);
+                break;
+            case 'r':
+                o->ss.rate = atoi(optarg);
+                break;
+            case 'c':
+                o->ss.channels = atoi(optarg);
+                break;
+            case 'n':
+                o->sessions = atoi(optarg);
+                break;
+            case 't':
+                o->seconds = atoi(optarg);
+                break;
+            case 'l':
+                o->block_usec = atoi(optarg) * PA_USEC_PER_MSEC;
+                break;
+            case 'x':
+                o->speed = atof(optarg);
+                break;
+            case 'T':
+                o->threaded = 1;
+                break;
+            case 'R':
+                o->replay = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (!pa_sample_spec_valid(&o->ss)) {
+        fprintf(stderr, "invalid sample spec\n");
+        return -1;
+    }
+    if (o->sessions < 1 || o->sessions > MAX_SESSIONS || o->seconds < 1 ||
+        o->block_usec == 0 || o->speed <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/* one sink block: payload stamped with the send time */
+static int drive_sink(struct session *s, char *block, size_t bytes) {
+    struct xrdp_send_frame frame;
+    uint64_t now;
+
+    now = pa_rtclock_now();
+    memcpy(block, &now, sizeof(now));
+    frame.h.code = XRDP_SINK_CODE_DATA;
+    frame.h.bytes = sizeof(frame.h) + bytes;
+    frame.data = block;
+    frame.bytes = bytes;
+    return xrdp_send_frames(s->sink_fd, &s->ring, &frame, 1, &s->stats) < 0 ? -1 : 0;
+}
+
+/* one source poll: READ for a block, then the data, like data_get() */
+static int drive_source(struct session *s, char *block, size_t bytes,
+                        struct samples *rtt) {
+    unsigned char cmd[XRDP_SOURCE_CMD_BYTES];
+    unsigned char len[2];
+    pa_usec_t start;
+    int got;
+
+    memset(cmd, 0, sizeof(cmd));
+    cmd[4] = XRDP_SOURCE_CMD_BYTES;
+    cmd[8] = XRDP_SOURCE_CMD_READ;
+    cmd[9] = bytes & 0xff;
+    cmd[10] = (bytes >> 8) & 0xff;
+
+    start = pa_rtclock_now();
+    if (xrdp_lsend(s->source_fd, (char *) cmd, sizeof(cmd)) != sizeof(cmd) ||
+        xrdp_lrecv(s->source_fd, (char *) len, 2) != 2) {
+        return -1;
+    }
+    got = len[0] | (len[1] << 8);
+    if (got > 0 && xrdp_lrecv(s->source_fd, block, got) != got) {
+        return -1;
+    }
+    samples_add(rtt, pa_rtclock_now() - start);
+    return 0;
+}
+
+/* map a capture and collect what the replay needs to know up front */
+static int replay_load(struct replay *r, const char *path) {
+    const struct xrdp_capture_record *rec;
+    const char *payload;
+    struct stat st;
+    pa_usec_t read_usec = 0;
+    int read_pending = 0;
+    size_t off = 0;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    r->size = st.st_size;
+    if (r->size < sizeof(r->h)) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        close(fd);
+        return -1;
+    }
+    r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) {
+        fprintf(stderr, "can't map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    memcpy(&r->h, r->map, sizeof(r->h));
+    if (memcmp(r->h.magic, XRDP_CAPTURE_MAGIC, sizeof(r->h.magic)) != 0) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return -1;
+    }
+
+    while ((rec = xrdp_capture_next(r->map, r->size, &off, &payload)) != NULL) {
+        r->records++;
+        r->duration = rec->usec;
+        if (rec->kind == XRDP_CAPTURE_SINK_FRAME && rec->bytes > sizeof(struct xrdp_header)) {
+            r->max_frame = MAX(r->max_frame, rec->bytes - sizeof(struct xrdp_header));
+        } else if (rec->kind == XRDP_CAPTURE_SOURCE_CMD &&
+                   rec->code == XRDP_SOURCE_CMD_READ) {
+            read_usec = rec->usec;
+            read_pending = 1;
+        } else if (rec->kind == XRDP_CAPTURE_SOURCE_DATA && read_pending) {
+            samples_add(&r->rtt, rec->usec - read_usec);
+            read_pending = 0;
+        }
+    }
+    return 0;
+}
+
+/* a recorded sink frame, audio from the capture if it has it. Data
+ * frames get the send time stamped in like drive_sink() */
+static int replay_sink(struct session *s, char *block,
+                       const struct xrdp_capture_record *r, const char *payload) {
+    struct xrdp_send_frame frame;
+    uint64_t now;
+    size_t bytes;
+
+    if (r->code == XRDP_SINK_CODE_SHM_SETUP || r->code == XRDP_SINK_CODE_SHM_DATA) {
+        /* the audio was in the memfd ring, there is nothing to send */
+        return 0;
+    }
+    bytes = r->bytes > sizeof(frame.h) ? r->bytes - sizeof(frame.h) : 0;
+    if (r->payload_bytes == bytes) {
+        memcpy(block, payload, bytes);
+    }
+    if (r->code == XRDP_SINK_CODE_DATA && bytes >= sizeof(now)) {
+        now = pa_rtclock_now();
+        memcpy(block, &now, sizeof(now));
+    }
+    frame.h.code = r->code;
+    frame.h.bytes = r->bytes;
+    frame.data = block;
+    frame.bytes = bytes;
+    return xrdp_send_frames(s->sink_fd, &s->ring, &frame, 1, &s->stats) < 0 ? -1 : 0;
+}
+
+/* one IO thread's worth of sessions, all of them unless -T is given */
+struct driver {
+    const struct options *o;
+    const struct replay *replay; /* NULL unless -R */
+    struct session *sessions;
+    int nsessions;
+    char *block;
+    size_t bytes;
+    pa_usec_t interval;
+    pa_usec_t end;
+    struct pollfd *fds;
+    pthread_t thread;
+
+    /* results */
+    struct samples rtt;
+    uint64_t blocks;
+    uint64_t wakeups;
+    pa_usec_t cpu;
+    int failed;
+};
+
+/* -R: send what the capture has due by now, then wait for the next
+ * record. Feedback and replies in the capture come from the mock now */
+static int replay_session(struct driver *d, struct session *s, pa_usec_t now) {
+    const struct xrdp_capture_record *r;
+    const char *payload;
+    pa_usec_t at;
+    size_t off;
+
+    for (;;) {
+        off = s->replay_off;
+        r = xrdp_capture_next(d->replay->map, d->replay->size, &off, &payload);
+        if (r == NULL) {
+            s->next = d->end;
+            return 0;
+        }
+        at = s->base + (pa_usec_t) (r->usec / d->o->speed);
+        if (at > now) {
+            s->next = at;
+            return 0;
+        }
+        s->replay_off = off;
+        if (r->kind == XRDP_CAPTURE_SINK_FRAME && d->o->sink) {
+            if (replay_sink(s, d->block, r, payload) != 0) {
+                return -1;
+            }
+            d->blocks++;
+        } else if (r->kind == XRDP_CAPTURE_SOURCE_CMD &&
+                   r->code == XRDP_SOURCE_CMD_READ && d->o->source) {
+            /* the mock speaks 16 bit lengths */
+            if (drive_source(s, d->block, MIN(r->bytes, 0xffff), &d->rtt) != 0) {
+                return -1;
+            }
+            d->blocks++;
+        }
+    }
+}
+
+/* the timer loop of a module IO thread, for every session it drives */
+static void *driver_thread(void *userdata) {
+    struct driver *d = userdata;
+    const struct options *o = d->o;
+    struct timespec timeout;
+    pa_usec_t now;
+    pa_usec_t next;
+    pa_usec_t cpu;
+    int nfds;
+    int i;
+
+    cpu = thread_cpu_usec();
+    while ((now = pa_rtclock_now()) < d->end) {
+        next = d->end;
+        nfds = 0;
+        for (i = 0; i < d->nsessions; i++) {
+            struct session *s = &d->sessions[i];
+
+            if (s->next <= now && d->replay) {
+                if (replay_session(d, s, now) != 0) {
+                    fprintf(stderr, "replay failed\n");
+                    d->failed = 1;
+                    return NULL;
+                }
+            } else if (s->next <= now) {
+                if (o->sink && drive_sink(s, d->block, d->bytes) != 0) {
+                    fprintf(stderr, "sink send failed\n");
+                    d->failed = 1;
+                    return NULL;
+                }
+                if (o->source && drive_source(s, d->block, d->bytes, &d->rtt) != 0) {
+                    fprintf(stderr, "source read failed\n");
+                    d->failed = 1;
+                    return NULL;
+                }
+                s->next += d->interval;
+                d->blocks++;
+            }
+            next = MIN(next, s->next);
+            if (o->sink && s->ring.len > 0) {
+                /* flush what the socket did not take, like the sink's
+                 * POLLOUT handling */
+                d->fds[nfds].fd = s->sink_fd;
+                d->fds[nfds].events = POLLOUT;
+                d->fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+
+        now = pa_rtclock_now();
+        next = next > now ? next - now : 0;
+        timeout.tv_sec = next / PA_USEC_PER_SEC;
+        timeout.tv_nsec = (next % PA_USEC_PER_SEC) * 1000;
+        ppoll(d->fds, nfds, &timeout, NULL);
+        d->wakeups++;
+        for (i = 0; i < d->nsessions && nfds > 0; i++) {
+            struct session *s = &d->sessions[i];
+
+            if (o->sink && s->ring.len > 0 &&
+                xrdp_send_frames(s->sink_fd, &s->ring, NULL, 0, &s->stats) < 0) {
+                d->failed = 1;
+                return NULL;
+            }
+        }
+    }
+    d->cpu = thread_cpu_usec() - cpu;
+    return NULL;
+}
+
+static pa_usec_t timeval_usec(const struct timeval *tv) {
+    return (pa_usec_t) tv->tv_sec * PA_USEC_PER_SEC + tv->tv_usec;
+}
+
+int main(int argc, char **argv) {
+    struct options o;
+    struct mock m;
+    struct session *sessions;
+    struct driver *drivers;
+    struct samples rtt;
+    struct xrdp_transport_stats total;
+    struct rusage ru_start;
+    struct rusage ru_end;
+    struct replay replay;
+    pthread_t thread;
+    char dir[] = "/tmp/xrdp-bench-XXXXXX";
+    char sink_path[64];
+    char source_path[64];
+    size_t bytes;
+    pa_usec_t interval;
+    pa_usec_t start;
+    pa_usec_t now;
+    pa_usec_t cpu;
+    uint64_t blocks;
+    uint64_t wakeups;
+    double secs;
+    long csw;
+    long icsw;
+    int ndrivers;
+    int i;
+    int rv = 1;
+    int thread_failed = 0;
+
+    if (parse_options(&o, argc, argv) != 0) {
+        return 1;
+    }
+    memset(&replay, 0, sizeof(replay));
+    if (o.replay) {
+        if (replay_load(&replay, o.replay) != 0) {
+            return 1;
+        }
+        /* the capture says what went over the wire */
+        o.ss.rate = replay.h.rate;
+        o.ss.channels = replay.h.channels;
+        o.ss.format = (pa_sample_format_t) replay.h.format;
+        if (!pa_sample_spec_valid(&o.ss)) {
+            fprintf(stderr, "bad sample spec in %s\n", o.replay);
+            return 1;
+        }
+    }
+    bytes = pa_usec_to_bytes(o.block_usec, &o.ss);
+    bytes = MAX(bytes, sizeof(uint64_t));
+    bytes = MIN(bytes, 0xffff - 0xffff % pa_frame_size(&o.ss));
+    /* a replayed READ can ask for up to 0xffff */
+    bytes = o.replay ? MAX(MAX(bytes, replay.max_frame), 0xffff) : bytes;
+    interval = (pa_usec_t) (o.block_usec / o.speed);
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+        return 1;
+    }
+    snprintf(sink_path, sizeof(sink_path), "%s/sink", dir);
+    snprintf(source_path, sizeof(source_path), "%s/source", dir);
+
+    memset(&m, 0, sizeof(m));
+    m.source_data = pa_xmalloc0(0xffff);
+    if ((m.sink_listen = listen_on(sink_path)) < 0 ||
+        (m.source_listen = listen_on(source_path)) < 0 ||
+        pipe(m.wake) != 0 ||
+        pthread_create(&thread, NULL, mock_thread, &m) != 0) {
+        return 1;
+    }
+
+    sessions = pa_xnew0(struct session, o.sessions);
+    /* done: closes whatever is >= 0, a failed connect leaves the rest */
+    for (i = 0; i < o.sessions; i++) {
+        sessions[i].sink_fd = -1;
+        sessions[i].source_fd = -1;
+    }
+    ndrivers = o.threaded ? o.sessions : 1;
+    drivers = pa_xnew0(struct driver, ndrivers);
+    start = pa_rtclock_now() + DRIVER_START_USEC;
+    for (i = 0; i < o.sessions; i++) {
+        struct session *s = &sessions[i];
+
+        if (o.sink) {
+            if ((s->sink_fd = connect_to(sink_path)) < 0) {
+                goto done;
+            }
+            pa_make_fd_nonblock(s->sink_fd);
+            xrdp_send_ring_init(&s->ring, SEND_RING_BYTES);
+        }
+        if (o.source && (s->source_fd = connect_to(source_path)) < 0) {
+            goto done;
+        }
+        /* spread the sessions over one block time */
+        s->next = start + interval * i / o.sessions;
+        s->base = s->next;
+    }
+    for (i = 0; i < ndrivers; i++) {
+        struct driver *d = &drivers[i];
+
+        d->o = &o;
+        d->replay = o.replay ? &replay : NULL;
+        d->nsessions = o.threaded ? 1 : o.sessions;
+        d->sessions = sessions + i * d->nsessions;
+        d->block = pa_xmalloc0(bytes);
+        d->bytes = bytes;
+        d->interval = interval;
+        d->end = start + (pa_usec_t) o.seconds * PA_USEC_PER_SEC;
+        if (o.replay) {
+            /* runs as long as the capture, and the spread */
+            d->end = start + (pa_usec_t) (replay.duration / o.speed) + interval;
+        }
+        d->fds = pa_xnew0(struct pollfd, d->nsessions);
+    }
+
+    printf("sessions %d mode %s%s%s spec %s %uch %uHz block_usec %llu speed %g%s\n",
+           o.sessions, o.sink ? "sink" : "", o.sink && o.source ? "+" : "",
+           o.source ? "source" : "", pa_sample_format_to_string(o.ss.format),
+           o.ss.channels, o.ss.rate, (unsigned long long) o.block_usec, o.speed,
+           o.threaded ? " thread per session" : "");
+    if (o.replay) {
+        printf("replay %s records %llu duration_usec %llu\n", o.replay,
+               (unsigned long long) replay.records,
+               (unsigned long long) replay.duration);
+    }
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    if (o.threaded) {
+        for (i = 0; i < ndrivers; i++) {
+            if (pthread_create(&drivers[i].thread, NULL, driver_thread,
+                               &drivers[i]) != 0) {
+                fprintf(stderr, "can't start session thread %d\n", i);
+                /* the ones started run to the end time, the run fails */
+                thread_failed = 1;
+                break;
+            }
+        }
+        ndrivers = i;
+        for (i = 0; i < ndrivers; i++) {
+            pthread_join(drivers[i].thread, NULL);
+        }
+    } else {
+        driver_thread(&drivers[0]);
+    }
+    getrusage(RUSAGE_SELF, &ru_end);
+    now = pa_rtclock_now();
+
+    rv = thread_failed;
+    for (i = 0; i < ndrivers; i++) {
+        if (drivers[i].failed) {
+            rv = 1;
+        }
+    }
+
+done:
+    for (i = 0; i < o.sessions; i++) {
+        if (sessions[i].sink_fd >= 0) {
+            close(sessions[i].sink_fd);
+        }
+        if (sessions[i].source_fd >= 0) {
+            close(sessions[i].source_fd);
+        }
+    }
+    /* let the mock drain the sockets before stopping it */
+    usleep(100 * 1000);
+    if (write(m.wake[1], "", 1) != 1) {
+        fprintf(stderr, "can't stop the mock chansrv: %s\n", strerror(errno));
+        return 1;
+    }
+    pthread_join(thread, NULL);
+
+    if (rv == 0) {
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < o.sessions; i++) {
+            total.bytes_sent += sessions[i].stats.bytes_sent;
+            total.frames_dropped += sessions[i].stats.frames_dropped;
+            total.short_writes += sessions[i].stats.short_writes;
+            total.eagain += sessions[i].stats.eagain;
+        }
+        memset(&rtt, 0, sizeof(rtt));
+        blocks = 0;
+        wakeups = 0;
+        cpu = 0;
+        for (i = 0; i < ndrivers; i++) {
+            size_t k;
+
+            blocks += drivers[i].blocks;
+            wakeups += drivers[i].wakeups;
+            cpu += drivers[i].cpu;
+            for (k = 0; k < drivers[i].rtt.n; k++) {
+                samples_add(&rtt, drivers[i].rtt.v[k]);
+            }
+        }
+        secs = (double) (now - start) / PA_USEC_PER_SEC;
+        csw = ru_end.ru_nvcsw - ru_start.ru_nvcsw;
+        icsw = ru_end.ru_nivcsw - ru_start.ru_nivcsw;
+
+        printf("throughput_bytes_per_sec %.0f (%.2fx real time per session)\n",
+               m.bytes / secs,
+               m.bytes / secs / pa_bytes_per_second(&o.ss) /
+               (o.sessions * ((o.sink ? 1 : 0) + (o.source ? 1 : 0))));
+        printf("frames %llu dropped %llu short_writes %llu eagain %llu\n",
+               (unsigned long long) m.frames,
+               (unsigned long long) total.frames_dropped,
+               (unsigned long long) total.short_writes,
+               (unsigned long long) total.eagain);
+        printf("cpu_usec_per_block %.2f\n", blocks ? (double) cpu / blocks : 0.0);
+        /* process wide, includes the mock chansrv */
+        printf("cpu_percent_per_session %.3f\n",
+               (timeval_usec(&ru_end.ru_utime) + timeval_usec(&ru_end.ru_stime) -
+                timeval_usec(&ru_start.ru_utime) - timeval_usec(&ru_start.ru_stime)) /
+               (secs * PA_USEC_PER_SEC) * 100 / o.sessions);
+        printf("context_switches_per_sec voluntary %.0f involuntary %.0f\n",
+               csw / secs, icsw / secs);
+        printf("wakeups_per_sec driver %.0f mock %.0f per_session %.1f\n",
+               wakeups / secs, m.wakeups / secs, wakeups / secs / o.sessions);
+        if (o.sink) {
+            samples_report("sink_latency", &m.latency);
+        }
+        if (o.source) {
+            samples_report("source_rtt", &rtt);
+            if (o.replay) {
+                samples_report("recorded_source_rtt", &replay.rtt);
+            }
+        }
+        pa_xfree(rtt.v);
+    }
+
+    for (i = 0; i < o.sessions; i++) {
+        xrdp_send_ring_done(&sessions[i].ring);
+    }
+    for (i = 0; i < (o.threaded ? o.sessions : 1); i++) {
+        pa_xfree(drivers[i].block);
+        pa_xfree(drivers[i].fds);
+        pa_xfree(drivers[i].rtt.v);
+    }
+    pa_xfree(drivers);
+    pa_xfree(sessions);
+    pa_xfree(m.source_data);
+    pa_xfree(m.latency.v);
+    if (replay.map) {
+        munmap(replay.map, replay.size);
+    }
+    pa_xfree(replay.rtt.v);
+    unlink(sink_path);
+    unlink(source_path);
+    rmdir(dir);
+    return rv;
+}
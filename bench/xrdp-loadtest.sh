@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Run xrdp-bench with one IO thread per session for a range of session
+# counts and print one line per count, to see how wakeups, context
+# switches and CPU scale from a handful of sessions to a full host.
+#
+# usage: xrdp-loadtest.sh [-b xrdp-bench] [-s "10 50 100 250 500"]
+#                         [-t seconds] [-- xrdp-bench options]
+
+BENCH=./xrdp-bench
+SESSIONS="10 50 100 250 500"
+SECONDS_PER_RUN=10
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -b) BENCH="$2"; shift 2 ;;
+        -s) SESSIONS="$2"; shift 2 ;;
+        -t) SECONDS_PER_RUN="$2"; shift 2 ;;
+        --) shift; break ;;
+        *) echo "usage: $0 [-b xrdp-bench] [-s counts] [-t seconds] [-- options]" >&2
+           exit 1 ;;
+    esac
+done
+
+# every session has a sink and a source socket on both ends, raise the
+# fd limit for the largest count and skip the counts it still can't fit
+max=0
+for n in $SESSIONS; do
+    [ "$n" -gt "$max" ] && max=$n
+done
+need=$((max * 4 + 64))
+if [ "`ulimit -n`" != unlimited ] && [ "`ulimit -n`" -lt "$need" ]; then
+    ulimit -n "$need" 2>/dev/null || ulimit -n "`ulimit -H -n`" 2>/dev/null
+fi
+limit=`ulimit -n`
+
+printf '%8s %10s %10s %10s %12s %12s %10s\n' \
+    sessions cpu%/sess csw/s icsw/s wakeups/s wake/sess p99_usec
+
+for n in $SESSIONS; do
+    if [ "$limit" != unlimited ] && [ $((n * 4 + 64)) -gt "$limit" ]; then
+        echo "skipping $n sessions, needs $((n * 4 + 64)) fds and ulimit -n is $limit" >&2
+        continue
+    fi
+    out=`$BENCH -T -n "$n" -t "$SECONDS_PER_RUN" "$@"` || {
+        echo "xrdp-bench failed for $n sessions" >&2
+        exit 1
+    }
+    echo "$out" | awk -v n="$n" '
+        $1 == "cpu_percent_per_session" { cpu = $2 }
+        $1 == "context_switches_per_sec" { csw = $3; icsw = $5 }
+        $1 == "wakeups_per_sec" { wake = $3; per = $7 }
+        # sink latency if there is one, else the source round trip
+        $1 == "sink_latency_usec" { p99 = $5 }
+        $1 == "source_rtt_usec" && p99 == "" { p99 = $5 }
+        END {
+            printf "%8d %10s %10s %10s %12s %12s %10s\n",
+                   n, cpu, csw, icsw, wake, per, p99
+        }'
+done
@@ -15,11 +15,23 @@ if [ -n "$XRDP_SESSION" -a -n "$XRDP_SOCKET_PATH" ]; then
     # Don't check for the presence of the sockets, as if the modules
     # are loaded they won't be there
 
-    # Unload modules
-    pactl unload-module module-xrdp-sink >/dev/null 2>&1
-    pactl unload-module module-xrdp-source >/dev/null 2>&1
+    # Unload modules, the calls don't depend on each other
+    pactl unload-module module-xrdp >/dev/null 2>&1 &
+    pactl unload-module module-xrdp-sink >/dev/null 2>&1 &
+    pactl unload-module module-xrdp-source >/dev/null 2>&1 &
+    wait
 
-    # Reload modules
+    # module-xrdp loads both and makes them the defaults in one call
+    if pactl load-module module-xrdp \
+           xrdp_socket_path=$XRDP_SOCKET_PATH \
+           xrdp_pulse_sink_socket=$XRDP_PULSE_SINK_SOCKET \
+           xrdp_pulse_source_socket=$XRDP_PULSE_SOURCE_SOCKET
+    then
+        echo "- pulseaudio xrdp-sink and xrdp-source loaded and set as default"
+        exit 0
+    fi
+
+    # Older installs without module-xrdp, load them one by one
     if pactl load-module module-xrdp-sink \
            xrdp_socket_path=$XRDP_SOCKET_PATH \
            xrdp_pulse_sink_socket=$XRDP_PULSE_SINK_SOCKET
@@ -31,6 +31,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/types.h>
 
@@ -42,6 +43,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <math.h>
 #include <sys/ioctl.h>
 #include <poll.h>
 
@@ -58,6 +60,11 @@
 #include <pulsecore/thread.h>
 #include <pulsecore/thread-mq.h>
 #include <pulsecore/rtpoll.h>
+#include <pulsecore/time-smoother.h>
+
+#ifdef XRDP_HAVE_OPUS
+#include <opus/opus.h>
+#endif
 
 /* defined in pulse/version.h */
 #if PA_PROTOCOL_VERSION > 28
@@ -69,6 +76,15 @@ typedef bool pa_bool_t;
 #endif
 
 #include "module-xrdp-sink-symdef.h"
+#include "xrdp-shm.h"
+#include "xrdp-convert.h"
+#include "xrdp-connect.h"
+#include "xrdp-common.h"
+#include "xrdp-transport.h"
+#include "xrdp-trace.h"
+#include "xrdp-sched.h"
+#include "xrdp-capture.h"
+#include "xrdp-snapshot.h"
 
 
 PA_MODULE_AUTHOR("Jay Sorg");
@@ -84,11 +100,114 @@ PA_MODULE_USAGE(
         "channel_map=<channel map> "
         "description=<description for the sink> "
         "xrdp_socket_path=<path to XRDP sockets> "
-        "xrdp_pulse_sink_socket=<name of sink socket>");
+        "xrdp_pulse_sink_socket=<name of sink socket> "
+        "batch_bytes=<render up to this many bytes into one frame, 0 to disable> "
+        "transport=<socket or memfd> "
+        "codec=<pcm or opus> "
+        "opus_bitrate=<bits per second> "
+        "silence_suppression=<send silence as a byte count> "
+        "silence_threshold=<peak below this counts as silence, 0 to 32767> "
+        "silence_hangover_msec=<keep sending audio this long after sound> "
+        "wire_conversion=<convert to S16 stereo in the module> "
+        "min_latency_msec=<smallest block size the controller may pick> "
+        "max_latency_msec=<largest block size> "
+        "rewind_msec=<keep this much rendered audio back for rewinds> "
+        "trace_file=<dump hot path events here, needs --enable-hotpath-trace> "
+        "timer_slack_usec=<let render wakeups be this late to share them> "
+        "sched=<inherit, rtkit, fifo or rr for the IO thread> "
+        "sched_priority=<realtime priority, 1 to 99> "
+        "cpu_affinity=<cpus for the IO thread, like 0-3,8> "
+        "rate_control=<pace rendering to keep chansrv's queue steady> "
+        "target_queue_msec=<queue depth rate_control holds, 0 for what it settles at> "
+        "low_latency_sink=<name for a second sink with short blocks on the same connection> "
+        "low_latency_msec=<largest block size of the low latency sink> "
+        "keep_warm=<stop rendering while idle but keep the stream to chansrv open> "
+        "capture_file=<record the socket traffic to this file> "
+        "capture_payload=<record the audio too, not only frame sizes> "
+        "capture_max_mb=<size of the capture file>");
 
 #define DEFAULT_SINK_NAME "xrdp-sink"
 #define BLOCK_USEC 30000
 //#define BLOCK_USEC (PA_USEC_PER_SEC * 2)
+/* how much audio the outbound buffer can hold while chansrv is not
+ * reading, beyond that new chunks are dropped */
+#define SEND_RING_USEC (BLOCK_USEC * 4)
+#define SEND_RING_SLACK 4096
+/* most frames packed into one sendmsg() call */
+#define MAX_SEND_FRAMES XRDP_SEND_MAX_FRAMES
+
+/* header.code values sent to chansrv */
+#define XRDP_SINK_CODE_DATA 0
+#define XRDP_SINK_CODE_CLOSE 1
+#define XRDP_SINK_CODE_SHM_SETUP 2 /* memfd attached, no payload */
+#define XRDP_SINK_CODE_SHM_DATA 3 /* wakeup, data is in the shm ring */
+#define XRDP_SINK_CODE_OPUS 4 /* one Opus packet */
+#define XRDP_SINK_CODE_OPUS_SETUP 5 /* uint32 rate, channels, frame samples */
+#define XRDP_SINK_CODE_SILENCE 6 /* uint32 bytes of silence */
+/* chansrv to module: uint32 wire format bytes chansrv and the client
+ * still have buffered, PCM equivalent for codec=opus. The header's
+ * bytes counts the header too, like the frames the sink sends */
+#define XRDP_SINK_CODE_QUEUED 7
+/* PCM and stop for the low_latency_sink stream, chansrv mixes it in with
+ * its own short buffer */
+#define XRDP_SINK_CODE_DATA_LL 8
+#define XRDP_SINK_CODE_CLOSE_LL 9
+/* chansrv to module: uint32 most channels and highest rate the client
+ * plays. Socket PCM only, without it chansrv gets the configured format */
+#define XRDP_SINK_CODE_CAPS 10
+/* module to chansrv: uint32 rate, channels and pa_sample_format_t of the
+ * data frames that follow, sent in answer to XRDP_SINK_CODE_CAPS */
+#define XRDP_SINK_CODE_FORMAT 11
+
+/* largest feedback message payload chansrv may send */
+#define FEEDBACK_MAX_PAYLOAD 16
+#define FEEDBACK_BUF_SIZE (sizeof(struct xrdp_header) + FEEDBACK_MAX_PAYLOAD)
+
+/* latency smoother, same settings as the alsa sink */
+#define SMOOTHER_ADJUST_USEC (1 * PA_USEC_PER_SEC)
+#define SMOOTHER_WINDOW_USEC (10 * PA_USEC_PER_SEC)
+
+/* block size controller timing */
+#define ADAPT_GROW_HOLDOFF_USEC (200 * PA_USEC_PER_MSEC)
+#define ADAPT_SHRINK_AFTER_USEC (5 * PA_USEC_PER_SEC)
+
+/* posted to the main thread when the controller picked a new block size,
+ * offset is the size in usec */
+#define SINK_MESSAGE_BLOCK_CHANGED (PA_SINK_MESSAGE_MAX + 1)
+
+/* how often the main thread puts changed stats into xrdp.stats.* */
+#define STATS_PUBLISH_USEC PA_USEC_PER_SEC
+
+/* rewind_msec: largest piece of held audio sent as one chunk */
+#define HOLD_SEND_BYTES (16 * 1024)
+
+#define DEFAULT_OPUS_BITRATE 96000
+/* Opus frame duration used for encoding */
+#define OPUS_FRAME_USEC 10000
+/* recommended upper bound for one Opus packet */
+#define OPUS_MAX_PACKET 1500
+
+#define DEFAULT_SILENCE_HANGOVER_MSEC 500
+
+/* pacing rate controller, see rate_update() */
+#define RATE_UPDATE_USEC PA_USEC_PER_SEC
+/* target_queue_msec=0 holds the depth seen this long after feedback starts */
+#define RATE_SETTLE_USEC (5 * PA_USEC_PER_SEC)
+/* a depth error is worked off over about this long */
+#define RATE_CORRECT_USEC (30 * PA_USEC_PER_SEC)
+/* the integral term, which ends up holding the clock drift, follows
+ * over about this long. With RATE_CORRECT_USEC that is critically damped */
+#define RATE_INTEGRATE_USEC (120 * PA_USEC_PER_SEC)
+#define RATE_MAX_PPM 2000
+
+#define DEFAULT_CAPTURE_MAX_MB 64
+
+/* low_latency_sink block size range */
+#define LL_MIN_LATENCY_USEC (2 * PA_USEC_PER_MSEC)
+#define DEFAULT_LL_MAX_LATENCY_MSEC 10
+
+/* render wakeups may be this late, well within one block */
+#define DEFAULT_TIMER_SLACK_USEC 500
 #define UNUSED_VAR(x) ((void) (x))
 
 /* support for the set_state_in_io_thread callback was added in 11.99.1 */
@@ -111,13 +230,98 @@ struct userdata {
 
     pa_usec_t block_usec;
     pa_usec_t timestamp;
-    pa_usec_t failed_connect_time;
     pa_usec_t last_send_time;
 
     int fd; /* unix domain socket connection to xrdp chansrv */
     int skip_bytes;
+    pa_rtpoll_item *rtpoll_item; /* POLLOUT watch on fd */
+    pa_sample_spec wire_ss; /* what goes to chansrv, see wire_conversion */
+    struct xrdp_send_ring send_ring; /* framed data not yet taken by chansrv */
+    struct xrdp_transport_stats stats;
+    struct xrdp_snapshot snapshot; /* written every wakeup, see snapshot_publish() */
+    struct xrdp_transport_stats stats_published; /* main thread, in the proplist */
+    pa_time_event *stats_event; /* main thread, see stats_timer_cb() */
+    pa_usec_t timer_deadline; /* what the rtpoll timer was set to, or 0 */
 
     char *sink_socket;
+    struct xrdp_connect conn; /* gets the fd for data_connect() */
+
+    size_t batch_bytes; /* 0 unless batch_bytes= was given */
+    pa_memblock *batch_memblock; /* reused for every batched render */
+
+    struct xrdp_shm shm; /* shm.hdr is set for transport=memfd */
+
+#ifdef XRDP_HAVE_OPUS
+    /* codec=opus, set up in pa__init() */
+    OpusEncoder *opus;
+    size_t opus_frame_bytes; /* PCM bytes per Opus frame */
+    char *opus_pcm; /* leftover PCM, less than one frame */
+    size_t opus_pcm_len;
+    unsigned char *opus_packets; /* MAX_SEND_FRAMES packet buffers */
+#endif
+
+    /* silence_suppression=yes */
+    int silence_suppression;
+    int silence_threshold; /* peak in S16 units */
+    pa_usec_t silence_hangover_usec;
+    size_t silence_hangover; /* bytes of silence still sent as audio */
+    size_t silence_run; /* bytes of silence rendered since the last sound */
+
+    /* the sink spec differs from wire_ss, see wire_setup() */
+    int wire_conversion; /* wire_conversion=yes, S16 on the wire */
+    uint32_t wire_max_channels; /* from XRDP_SINK_CODE_CAPS, or 0 */
+    int convert;
+    struct xrdp_convert conv;
+    pa_memblock *convert_memblock; /* reused for the converted chunks */
+
+    /* latency feedback, see downstream_usec() */
+    pa_smoother *smoother;
+    pa_usec_t smoother_base; /* time offset the smoother was reset with */
+    pa_usec_t downstream_usec; /* smoothed depth as of the last update */
+    uint32_t chansrv_queued; /* last XRDP_SINK_CODE_QUEUED value */
+    char recv_buf[FEEDBACK_BUF_SIZE]; /* partial feedback message */
+    size_t recv_len;
+
+    /* block size controller, see adapt_block() */
+    pa_usec_t min_latency_usec;
+    pa_usec_t max_latency_usec;
+    pa_usec_t requested_usec; /* what the sink inputs asked for */
+    pa_usec_t adapt_usec; /* the controller's block size */
+    pa_usec_t adapt_last_grow;
+    pa_usec_t adapt_stable_since;
+    int adapt_events; /* stalls seen since the last grow */
+
+    /* rewind_msec, rendered audio kept back so a rewind can replace it */
+    pa_usec_t hold_usec;
+    size_t hold_bytes;
+    struct xrdp_send_ring hold; /* hold.buf is set for rewind_msec > 0 */
+
+    struct xrdp_trace trace; /* trace_file=, see xrdp-trace.h */
+    struct xrdp_capture capture; /* capture_file=, see xrdp-capture.h */
+    struct xrdp_sched sched; /* applied by the IO thread */
+
+    pa_usec_t timer_slack_usec; /* set on the IO thread */
+
+    /* rate_control=yes, the render clock follows chansrv's consumption */
+    int rate_control;
+    pa_usec_t rate_target_cfg; /* target_queue_msec, 0 to pick one */
+    pa_usec_t rate_target; /* depth being held, 0 until picked */
+    pa_usec_t rate_start; /* first feedback since the last reset, or 0 */
+    pa_usec_t rate_last; /* last controller step, or 0 */
+    double rate_drift; /* integral term, kept across resets */
+    double rate_ratio; /* render clock usec per usec of audio */
+
+    /* low_latency_sink=, a second sink rendered by the same thread in
+     * its own short blocks */
+    pa_sink *ll_sink;
+    pa_usec_t ll_timestamp;
+    pa_usec_t ll_block_usec;
+    int ll_open; /* sent DATA_LL since the last CLOSE_LL */
+
+    /* keep_warm=yes, an idle sink is parked with its timer off instead
+     * of rendering silence, chansrv only gets a CLOSE on suspend */
+    int keep_warm;
+    int parked;
 };
 
 static const char* const valid_modargs[] = {
@@ -130,78 +334,222 @@ static const char* const valid_modargs[] = {
     "xrdp_socket_path",
     "xrdp_pulse_sink_socket",
     "description",
+    "batch_bytes",
+    "transport",
+    "codec",
+    "opus_bitrate",
+    "silence_suppression",
+    "silence_threshold",
+    "silence_hangover_msec",
+    "wire_conversion",
+    "min_latency_msec",
+    "max_latency_msec",
+    "rewind_msec",
+    "trace_file",
+    "timer_slack_usec",
+    "sched",
+    "sched_priority",
+    "cpu_affinity",
+    "rate_control",
+    "target_queue_msec",
+    "low_latency_sink",
+    "low_latency_msec",
+    "keep_warm",
+    "capture_file",
+    "capture_payload",
+    "capture_max_mb",
     NULL
 };
 
-static int close_send(struct userdata *u);
+static int close_send(struct userdata *u, int code);
+static int send_frames(struct userdata *u, struct xrdp_send_frame *frames, int nframes);
 
-static pa_device_port *xrdp_create_port(struct userdata *u) {
-    pa_device_port_new_data data;
-    pa_device_port *port;
+/* wire format bytes queued on our side of chansrv: the send ring or shm
+ * ring and the kernel socket buffer */
+static size_t local_queued_bytes(struct userdata *u) {
+    if (u->shm.hdr) {
+        return xrdp_shm_readable(&u->shm);
+    }
+#ifdef XRDP_HAVE_OPUS
+    if (u->opus) {
+        /* the socket holds compressed packets, only count the PCM
+         * still waiting for a full frame */
+        return u->opus_pcm_len;
+    }
+#endif
+    /* frame headers are counted too, they are small */
+    return u->send_ring.len + xrdp_socket_outq(u->fd);
+}
 
-    pa_device_port_new_data_init(&data);
+/* audio queued between us and the speaker, our side plus what chansrv
+ * last reported */
+static pa_usec_t downstream_usec(struct userdata *u) {
+    if (u->fd < 0) {
+        return 0;
+    }
+    return pa_bytes_to_usec(local_queued_bytes(u) + u->chansrv_queued,
+                            &u->wire_ss);
+}
 
-    pa_device_port_new_data_set_name(&data, "xrdp-output");
-    pa_device_port_new_data_set_description(&data, "xrdp output");
-    pa_device_port_new_data_set_direction(&data, PA_DIRECTION_OUTPUT);
-    pa_device_port_new_data_set_available(&data, PA_AVAILABLE_YES);
-#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(14, 0, 0)
-    pa_device_port_new_data_set_type(&data, PA_DEVICE_PORT_TYPE_NETWORK);
-#endif
+/* apply the requested latency and the controller's block size */
+static void block_update(struct userdata *u) {
+    size_t nbytes;
 
-    port = pa_device_port_new(u->core, &data, 0);
+    u->block_usec = MIN(u->requested_usec, u->adapt_usec);
+    nbytes = pa_usec_to_bytes(u->block_usec, &u->sink->sample_spec);
+    /* only held audio can be rewound, the rest is on the wire */
+    pa_sink_set_max_rewind_within_thread(u->sink, u->hold_bytes);
+    pa_sink_set_max_request_within_thread(u->sink, nbytes);
+}
 
-    pa_device_port_new_data_done(&data);
+/* called after each render. Stalls, a backed up local queue and chansrv
+ * running dry grow the block size quickly, a quiet stretch shrinks it
+ * slowly again */
+static void adapt_block(struct userdata *u, pa_usec_t now) {
+    pa_usec_t target;
 
-    if (port == NULL)
-    {
-        return NULL;
+    if (u->min_latency_usec >= u->max_latency_usec) {
+        return;
+    }
+    if (u->fd >= 0 &&
+        local_queued_bytes(u) > pa_usec_to_bytes(u->block_usec, &u->wire_ss)) {
+        u->adapt_events++;
     }
 
-    pa_device_port_ref(port);
+    target = u->adapt_usec;
+    if (u->adapt_events > 0) {
+        u->adapt_stable_since = now;
+        if (now - u->adapt_last_grow >= ADAPT_GROW_HOLDOFF_USEC) {
+            target = MIN(target * 3 / 2, u->max_latency_usec);
+            u->adapt_last_grow = now;
+            u->adapt_events = 0;
+        }
+    } else if (now - u->adapt_stable_since >= ADAPT_SHRINK_AFTER_USEC) {
+        target = MAX(target * 9 / 10, u->min_latency_usec);
+        u->adapt_stable_since = now;
+    }
 
-    return port;
+    if (target != u->adapt_usec) {
+        pa_log_debug("adapt_block: block size %llu -> %llu usec",
+                     (unsigned long long) u->adapt_usec,
+                     (unsigned long long) target);
+        u->adapt_usec = target;
+        block_update(u);
+        /* the proplist belongs to the main thread */
+        pa_asyncmsgq_post(u->thread_mq.outq, PA_MSGOBJECT(u->sink),
+                          SINK_MESSAGE_BLOCK_CHANGED, NULL,
+                          (int64_t) target, NULL, NULL);
+    }
 }
 
-static pa_card_profile *xrdp_create_profile() {
-    pa_card_profile *profile;
+/* wait for feedback again before steering, the drift estimate stays */
+static void rate_reset(struct userdata *u) {
+    u->rate_target = u->rate_target_cfg;
+    u->rate_start = 0;
+    u->rate_last = 0;
+    u->rate_ratio = 1.0 + u->rate_drift;
+}
 
-    profile = pa_card_profile_new("output:xrdp", "xrdp audio output", 0);
-    profile->priority = 10;
-    profile->n_sinks = 1;
-    profile->n_sources = 0;
-    profile->max_sink_channels = 2;
-    profile->max_source_channels = 0;
+/* render clock time 'bytes' of sink audio stand for */
+static pa_usec_t render_usec(struct userdata *u, size_t bytes) {
+    pa_usec_t usec;
 
-    return profile;
+    usec = pa_bytes_to_usec(bytes, &u->sink->sample_spec);
+    if (u->rate_ratio == 1.0) {
+        return usec;
+    }
+    return (pa_usec_t) (usec * u->rate_ratio + 0.5);
 }
 
-static pa_card *xrdp_create_card(pa_module *m, pa_device_port *port, pa_card_profile *profile) {
-    pa_card_new_data data;
-    pa_card *card;
-
-    pa_card_new_data_init(&data);
-    data.driver = __FILE__;
+/* start the smoother and the shrink timer over, e.g. when the sink
+ * starts running */
+static void latency_reset(struct userdata *u, pa_usec_t now) {
+    u->smoother_base = now;
+    pa_smoother_reset(u->smoother, now, FALSE);
+    u->downstream_usec = 0;
+    u->adapt_stable_since = now;
+    rate_reset(u);
+}
 
-    pa_card_new_data_set_name(&data, "xrdp.sink");
+/* smoothed downstream depth, added to the render timestamp delta when
+ * answering PA_SINK_MESSAGE_GET_LATENCY, see latency_update() */
+static pa_usec_t smoothed_downstream_usec(struct userdata *u, pa_usec_t now) {
+    pa_usec_t x;
+    pa_usec_t y;
 
-    pa_hashmap_put(data.ports, port->name, port);
-    pa_hashmap_put(data.profiles, profile->name, profile);
+    if (u->fd < 0 || now < u->smoother_base) {
+        return 0;
+    }
+    x = now - u->smoother_base;
+    y = pa_smoother_get(u->smoother, now);
+    return x > y ? x - y : 0;
+}
 
-    card = pa_card_new(m->core, &data);
+/* feed the smoother a sample of the downstream depth. It models a
+ * playback clock that lags the system clock by that depth */
+static void latency_update(struct userdata *u, pa_usec_t now) {
+    pa_usec_t x;
+    pa_usec_t d;
 
-    pa_card_new_data_done(&data);
+    if (u->fd < 0 || now < u->smoother_base) {
+        return;
+    }
+    x = now - u->smoother_base;
+    d = downstream_usec(u);
+    pa_smoother_put(u->smoother, now, x > d ? x - d : 0);
+    /* GET_LATENCY uses this rather than asking the smoother each time */
+    u->downstream_usec = smoothed_downstream_usec(u, now);
+}
 
-    if (card == NULL)
-    {
-        return NULL;
+/* PI controller on the smoothed downstream depth. A client playing
+ * slower than we render makes the queue grow, so the render clock is
+ * stretched, and squeezed when it plays faster */
+static void rate_update(struct userdata *u, pa_usec_t now) {
+    pa_usec_t depth;
+    pa_usec_t dt;
+    double err;
+    double off;
+    double max;
+
+    if (!u->rate_control || u->fd < 0 || u->rate_start == 0 ||
+        now < u->rate_last + RATE_UPDATE_USEC ||
+        now < u->rate_start + RATE_SETTLE_USEC) {
+        return;
+    }
+    dt = u->rate_last > 0 ? now - u->rate_last : RATE_UPDATE_USEC;
+    dt = MIN(dt, 2 * RATE_UPDATE_USEC);
+    u->rate_last = now;
+
+    depth = u->downstream_usec;
+    if (u->rate_target == 0) {
+        u->rate_target = MAX(depth, u->block_usec);
+        pa_log_info("rate_update: holding chansrv queue at %llu usec",
+                    (unsigned long long) u->rate_target);
+        return;
     }
 
-    pa_card_choose_initial_profile(card);
+    max = RATE_MAX_PPM / 1e6;
+    err = ((double) depth - (double) u->rate_target) / RATE_CORRECT_USEC;
+    u->rate_drift += err * dt / RATE_INTEGRATE_USEC;
+    u->rate_drift = PA_CLAMP(u->rate_drift, -max, max);
+    off = PA_CLAMP(err + u->rate_drift, -max, max);
+    u->rate_ratio = 1.0 + off;
+    u->stats.drift_ppm = (int32_t) lrint(off * 1e6);
+}
 
-    pa_card_put(card);
+/* channels is what the sink is created with, chansrv may take fewer, see
+ * wire_negotiate() */
+static pa_card_profile *xrdp_create_profile(uint8_t channels) {
+    pa_card_profile *profile;
 
-    return card;
+    profile = pa_card_profile_new("output:xrdp", "xrdp audio output", 0);
+    profile->priority = 10;
+    profile->n_sinks = 1;
+    profile->n_sources = 0;
+    profile->max_sink_channels = channels;
+    profile->max_source_channels = 0;
+
+    return profile;
 }
 
 static int sink_process_msg(pa_msgobject *o, int code, void *data,
@@ -209,7 +557,7 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data,
 
     struct userdata *u = PA_SINK(o)->userdata;
     pa_usec_t now;
-    long lat;
+    pa_usec_t lat;
 
     switch (code) {
 
@@ -222,31 +570,53 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data,
             break;
 
         case PA_SINK_MESSAGE_GET_LATENCY:
-            pa_log_debug("sink_process_msg: PA_SINK_MESSAGE_GET_LATENCY");
             now = pa_rtclock_now();
             lat = u->timestamp > now ? u->timestamp - now : 0ULL;
-            pa_log_debug("sink_process_msg: lat %ld", lat);
+            lat += u->downstream_usec;
             *((pa_usec_t*) data) = lat;
+            XRDP_TRACE(&u->trace, XRDP_TRACE_LATENCY, lat);
             return 0;
 
-        case PA_SINK_MESSAGE_GET_REQUESTED_LATENCY:
-            pa_log_debug("sink_process_msg: PA_SINK_MESSAGE_GET_REQUESTED_LATENCY");
-            break;
+        case SINK_MESSAGE_BLOCK_CHANGED: {
+            /* main thread, posted by adapt_block() */
+            pa_proplist *pl;
 
+            if (PA_SINK_IS_LINKED(u->sink->state)) {
+                pl = pa_proplist_new();
+                pa_proplist_setf(pl, "xrdp.block_usec", "%llu",
+                                 (unsigned long long) offset);
+                pa_sink_update_proplist(u->sink, PA_UPDATE_REPLACE, pl);
+                pa_proplist_free(pl);
+            }
+            return 0;
+        }
+
+#ifndef USE_SET_STATE_IN_IO_THREAD_CB
         case PA_SINK_MESSAGE_SET_STATE:
             pa_log_debug("sink_process_msg: PA_SINK_MESSAGE_SET_STATE");
             if (PA_PTR_TO_UINT(data) == PA_SINK_RUNNING) /* 0 */ {
                 pa_log("sink_process_msg: running");
 
                 u->timestamp = pa_rtclock_now();
+                latency_reset(u, u->timestamp);
+                if (u->hold.buf) {
+                    xrdp_send_ring_consume(&u->hold, u->hold.len);
+                }
             } else {
                 pa_log("sink_process_msg: not running");
-                close_send(u);
+                if (!u->keep_warm || PA_PTR_TO_UINT(data) == PA_SINK_SUSPENDED) {
+                    close_send(u, XRDP_SINK_CODE_CLOSE);
+                }
+                if (PA_PTR_TO_UINT(data) == PA_SINK_SUSPENDED) {
+                    /* pactl suspend-sink dumps the trace */
+                    xrdp_trace_dump(&u->trace);
+                }
             }
             break;
+#endif
 
         default:
-            pa_log_debug("sink_process_msg: code %d", code);
+            XRDP_TRACE(&u->trace, XRDP_TRACE_MSG, code);
 
     }
 
@@ -266,13 +636,32 @@ static int sink_set_state_in_io_thread_cb(pa_sink *s,
     pa_assert(s);
     pa_assert_se(u = s->userdata);
 
-    if (s->thread_info.state == PA_SINK_SUSPENDED || s->thread_info.state == PA_SINK_INIT)
-    {
-        if (PA_SINK_IS_OPENED(new_state))
-        {
-            pa_log_debug("sink_set_state_in_io_thread_cb: set timestamp");
+    if (new_state == PA_SINK_RUNNING) {
+        if (s->thread_info.state != PA_SINK_RUNNING) {
+            pa_log("sink_set_state_in_io_thread_cb: running");
             u->timestamp = pa_rtclock_now();
+            latency_reset(u, u->timestamp);
+            if (u->hold.buf) {
+                xrdp_send_ring_consume(&u->hold, u->hold.len);
+            }
         }
+    } else if ((s->thread_info.state == PA_SINK_SUSPENDED ||
+                s->thread_info.state == PA_SINK_INIT) &&
+               PA_SINK_IS_OPENED(new_state)) {
+        pa_log_debug("sink_set_state_in_io_thread_cb: set timestamp");
+        u->timestamp = pa_rtclock_now();
+        latency_reset(u, u->timestamp);
+    } else if (s->thread_info.state == PA_SINK_RUNNING ||
+               new_state == PA_SINK_SUSPENDED) {
+        pa_log("sink_set_state_in_io_thread_cb: not running");
+        /* keep_warm leaves the stream open while idle */
+        if (!u->keep_warm || new_state == PA_SINK_SUSPENDED) {
+            close_send(u, XRDP_SINK_CODE_CLOSE);
+        }
+    }
+    if (new_state == PA_SINK_SUSPENDED && s->thread_info.state != PA_SINK_SUSPENDED) {
+        /* pactl suspend-sink dumps the trace */
+        xrdp_trace_dump(&u->trace);
     }
 
     return 0;
@@ -281,24 +670,108 @@ static int sink_set_state_in_io_thread_cb(pa_sink *s,
 
 static void sink_update_requested_latency_cb(pa_sink *s) {
     struct userdata *u;
-    size_t nbytes;
 
     pa_sink_assert_ref(s);
     pa_assert_se(u = s->userdata);
 
-    u->block_usec = pa_sink_get_requested_latency_within_thread(s);
+    u->requested_usec = pa_sink_get_requested_latency_within_thread(s);
+
+    if (u->requested_usec == (pa_usec_t) -1) {
+        u->requested_usec = s->thread_info.max_latency;
+    }
+    block_update(u);
+}
+
+/* low_latency_sink: only the latency and state messages differ from the
+ * main sink, audio is never held back so there is nothing to rewind */
+static int ll_sink_process_msg(pa_msgobject *o, int code, void *data,
+                               int64_t offset, pa_memchunk *chunk) {
+    struct userdata *u = PA_SINK(o)->userdata;
+    pa_usec_t now;
+    pa_usec_t lat;
+
+    switch (code) {
+
+        case PA_SINK_MESSAGE_GET_LATENCY:
+            /* chansrv keeps this stream in its own short buffer, only
+             * our side of the socket is shared with the main sink */
+            now = pa_rtclock_now();
+            lat = u->ll_timestamp > now ? u->ll_timestamp - now : 0ULL;
+            if (u->fd >= 0) {
+                lat += pa_bytes_to_usec(local_queued_bytes(u), &u->wire_ss);
+            }
+            *((pa_usec_t*) data) = lat;
+            return 0;
 
-    if (u->block_usec == (pa_usec_t) -1) {
-        u->block_usec = s->thread_info.max_latency;
+#ifndef USE_SET_STATE_IN_IO_THREAD_CB
+        case PA_SINK_MESSAGE_SET_STATE:
+            if (PA_PTR_TO_UINT(data) == PA_SINK_RUNNING) {
+                u->ll_timestamp = pa_rtclock_now();
+            } else if (u->ll_open) {
+                close_send(u, XRDP_SINK_CODE_CLOSE_LL);
+                u->ll_open = 0;
+            }
+            break;
+#endif
     }
-    nbytes = pa_usec_to_bytes(u->block_usec, &s->sample_spec);
-    pa_sink_set_max_rewind_within_thread(s, nbytes);
-    pa_sink_set_max_request_within_thread(s, nbytes);
+
+    return pa_sink_process_msg(o, code, data, offset, chunk);
 }
 
-static void process_rewind(struct userdata *u, pa_usec_t now) {
+#ifdef USE_SET_STATE_IN_IO_THREAD_CB
+static int ll_sink_set_state_in_io_thread_cb(pa_sink *s,
+                                             pa_sink_state_t new_state,
+                                             pa_suspend_cause_t new_suspend_cause)
+{
+    struct userdata *u;
+
+    UNUSED_VAR(new_suspend_cause);
+
+    pa_assert(s);
+    pa_assert_se(u = s->userdata);
+
+    if (new_state == PA_SINK_RUNNING) {
+        if (s->thread_info.state != PA_SINK_RUNNING) {
+            u->ll_timestamp = pa_rtclock_now();
+        }
+    } else {
+        if ((s->thread_info.state == PA_SINK_SUSPENDED ||
+             s->thread_info.state == PA_SINK_INIT) &&
+            PA_SINK_IS_OPENED(new_state)) {
+            u->ll_timestamp = pa_rtclock_now();
+        }
+        if (u->ll_open) {
+            close_send(u, XRDP_SINK_CODE_CLOSE_LL);
+            u->ll_open = 0;
+        }
+    }
+
+    return 0;
+}
+#endif /* USE_SET_STATE_IN_IO_THREAD_CB */
+
+/* the low latency sink follows its inputs directly, no controller */
+static void ll_sink_update_requested_latency_cb(pa_sink *s) {
+    struct userdata *u;
+    pa_usec_t requested;
+
+    pa_sink_assert_ref(s);
+    pa_assert_se(u = s->userdata);
+
+    requested = pa_sink_get_requested_latency_within_thread(s);
+    if (requested == (pa_usec_t) -1) {
+        requested = s->thread_info.max_latency;
+    }
+    u->ll_block_usec = PA_CLAMP(requested, s->thread_info.min_latency,
+                                s->thread_info.max_latency);
+    pa_sink_set_max_request_within_thread(s,
+        pa_usec_to_bytes(u->ll_block_usec, &s->sample_spec));
+}
+
+/* audio that was sent already can't be taken back, so only the hold
+ * ring of rewind_msec is rewindable */
+static void process_rewind(struct userdata *u) {
     size_t rewind_nbytes, in_buffer;
-    pa_usec_t delay;
 
     pa_assert(u);
 
@@ -307,24 +780,20 @@ static void process_rewind(struct userdata *u, pa_usec_t now) {
     if (!PA_SINK_IS_OPENED(u->sink->thread_info.state) || rewind_nbytes <= 0)
         goto do_nothing;
 
-    pa_log_debug("Requested to rewind %lu bytes.", (unsigned long) rewind_nbytes);
-
-    if (u->timestamp <= now)
-        goto do_nothing;
-
-    delay = u->timestamp - now;
-    in_buffer = pa_usec_to_bytes(delay, &u->sink->sample_spec);
+    in_buffer = u->hold.len;
 
     if (in_buffer <= 0)
         goto do_nothing;
 
     if (rewind_nbytes > in_buffer)
         rewind_nbytes = in_buffer;
+    rewind_nbytes = pa_frame_align(rewind_nbytes, &u->sink->sample_spec);
 
     pa_sink_process_rewind(u->sink, rewind_nbytes);
-    u->timestamp -= pa_bytes_to_usec(rewind_nbytes, &u->sink->sample_spec);
+    xrdp_send_ring_unwrite(&u->hold, rewind_nbytes);
+    u->timestamp -= render_usec(u, rewind_nbytes);
 
-    pa_log_debug("Rewound %lu bytes.", (unsigned long) rewind_nbytes);
+    XRDP_TRACE(&u->trace, XRDP_TRACE_REWIND, rewind_nbytes);
     return;
 
 do_nothing:
@@ -332,147 +801,709 @@ do_nothing:
     pa_sink_process_rewind(u->sink, 0);
 }
 
-struct header {
-    int code;
-    int bytes;
-};
+/* what goes on the wire before chansrv sends its caps */
+static uint8_t wire_default_channels(struct userdata *u) {
+    return u->wire_conversion ? 2 : u->sink->sample_spec.channels;
+}
+
+/* pick the wire spec for 'channels' channels of the sink's audio, the
+ * module only converts when the format or the layout has to change */
+static int wire_setup(struct userdata *u, uint8_t channels) {
+    pa_sample_spec ss;
+    pa_channel_map map;
+    int rv = 0;
+
+    ss = u->sink->sample_spec;
+    map = u->sink->channel_map;
+    if (u->wire_conversion) {
+        ss.format = PA_SAMPLE_S16NE;
+    }
+    if (channels != ss.channels) {
+        ss.channels = channels;
+        if (channels == 2) {
+            pa_channel_map_init_stereo(&map);
+        } else if (!pa_channel_map_init_auto(&map, channels, PA_CHANNEL_MAP_DEFAULT)) {
+            return -1;
+        }
+    }
+
+    xrdp_convert_done(&u->conv);
+    u->convert = 0;
+    if (!pa_sample_spec_equal(&ss, &u->sink->sample_spec) ||
+        !pa_channel_map_equal(&map, &u->sink->channel_map)) {
+        /* down or upmix here instead of in the generic remapper */
+        if (xrdp_convert_init(&u->conv, u->core,
+                              &u->sink->sample_spec, &u->sink->channel_map,
+                              &ss, &map) != 0) {
+            ss = u->sink->sample_spec;
+            rv = -1;
+        } else {
+            u->convert = 1;
+        }
+    }
+    u->wire_ss = ss;
+    /* the hangover stays the same length of time */
+    u->silence_hangover = pa_usec_to_bytes(u->silence_hangover_usec, &u->wire_ss);
+    return rv;
+}
 
-static int get_display_num_from_display(const char *display_text) {
-    int index;
-    int mode;
-    int host_index;
-    int disp_index;
-    int scre_index;
-    int display_num;
-    char host[256];
-    char disp[256];
-    char scre[256];
-
-    if (display_text == NULL) {
+/* XRDP_SINK_CODE_CAPS: pass the sink's channels through if the client
+ * takes them, downmix in the module if not, then tell chansrv */
+static int wire_negotiate(struct userdata *u, uint32_t max_channels, uint32_t max_rate) {
+    struct xrdp_send_frame frame;
+    uint32_t params[3];
+    uint8_t channels;
+
+    if (u->shm.hdr || max_channels == 0) {
+        /* the FORMAT frame could not be ordered against the shm ring */
+        pa_log_debug("wire_negotiate: ignoring caps");
         return 0;
     }
-    memset(host, 0, 256);
-    memset(disp, 0, 256);
-    memset(scre, 0, 256);
-
-    index = 0;
-    host_index = 0;
-    disp_index = 0;
-    scre_index = 0;
-    mode = 0;
-
-    while (display_text[index] != 0) {
-        if (display_text[index] == ':') {
-            mode = 1;
-        } else if (display_text[index] == '.') {
-            mode = 2;
-        } else if (mode == 0) {
-            host[host_index] = display_text[index];
-            host_index++;
-        } else if (mode == 1) {
-            disp[disp_index] = display_text[index];
-            disp_index++;
-        } else if (mode == 2) {
-            scre[scre_index] = display_text[index];
-            scre_index++;
-        }
-        index++;
-    }
-
-    host[host_index] = 0;
-    disp[disp_index] = 0;
-    scre[scre_index] = 0;
-    display_num = atoi(disp);
-    return display_num;
-}
-
-static int lsend(int fd, char *data, int bytes) {
-    int sent = 0;
-    int error;
-    while (sent < bytes) {
-        error = send(fd, data + sent, bytes - sent, 0);
-        if (error < 1) {
-            return error;
+#ifdef XRDP_HAVE_OPUS
+    if (u->opus) {
+        /* OPUS_SETUP told chansrv already */
+        return 0;
+    }
+#endif
+    if (max_rate > 0 && max_rate < u->sink->sample_spec.rate) {
+        pa_log_warn("client plays at most %u Hz, the sink runs at %u Hz",
+                    max_rate, u->sink->sample_spec.rate);
+    }
+
+    channels = MIN(max_channels, u->sink->sample_spec.channels);
+    if (wire_setup(u, channels) != 0) {
+        pa_log("wire_negotiate: can't send %u channels, keeping %u",
+               channels, wire_default_channels(u));
+        wire_setup(u, wire_default_channels(u));
+    }
+    u->wire_max_channels = max_channels;
+    pa_log_info("wire format %s %uch %u Hz, %s",
+                pa_sample_format_to_string(u->wire_ss.format),
+                u->wire_ss.channels, u->wire_ss.rate,
+                u->convert ? u->conv.impl : "passed through");
+
+    params[0] = u->wire_ss.rate;
+    params[1] = u->wire_ss.channels;
+    params[2] = u->wire_ss.format;
+    frame.h.code = XRDP_SINK_CODE_FORMAT;
+    frame.h.bytes = sizeof(params) + 8;
+    frame.data = (const char*) params;
+    frame.bytes = sizeof(params);
+    return send_frames(u, &frame, 1) == 1 ? 0 : -1;
+}
+
+/* close the chansrv connection and drop whatever is still queued */
+static void data_close(struct userdata *u) {
+    if (u->rtpoll_item) {
+        pa_rtpoll_item_free(u->rtpoll_item);
+        u->rtpoll_item = NULL;
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+        u->fd = -1;
+    }
+    xrdp_send_ring_consume(&u->send_ring, u->send_ring.len);
+    u->chansrv_queued = 0;
+    u->recv_len = 0;
+    u->downstream_usec = 0;
+    rate_reset(u);
+    if (u->wire_max_channels > 0) {
+        /* the next chansrv may not send caps */
+        wire_setup(u, wire_default_channels(u));
+        u->wire_max_channels = 0;
+    }
+}
+
+/* read the feedback messages chansrv sends back without blocking,
+ * returns -1 if the connection is gone or chansrv sent garbage */
+static int data_read_feedback(struct userdata *u) {
+    struct xrdp_header h;
+    uint32_t queued;
+    uint32_t caps[2];
+    size_t msg_bytes;
+    ssize_t got;
+
+    for (;;) {
+        do {
+            got = recv(u->fd, u->recv_buf + u->recv_len,
+                       sizeof(u->recv_buf) - u->recv_len, MSG_DONTWAIT);
+        } while (got < 0 && errno == EINTR);
+        if (got == 0) {
+            pa_log("chansrv closed the connection");
+            return -1;
+        }
+        if (got < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            pa_log("data_read_feedback: recv failed: %s", pa_cstrerror(errno));
+            return -1;
+        }
+        u->recv_len += got;
+        u->stats.recv_calls++;
+        u->stats.bytes_received += got;
+
+        /* handle every complete message, keep a partial one */
+        while (u->recv_len >= sizeof(h)) {
+            memcpy(&h, u->recv_buf, sizeof(h));
+            if (h.bytes < (int) sizeof(h) ||
+                h.bytes > (int) sizeof(h) + FEEDBACK_MAX_PAYLOAD) {
+                pa_log("data_read_feedback: bad message code %d bytes %d",
+                       h.code, h.bytes);
+                return -1;
+            }
+            msg_bytes = h.bytes;
+            if (u->recv_len < msg_bytes) {
+                break;
+            }
+            u->stats.frames_received++;
+            xrdp_capture_add(&u->capture, XRDP_CAPTURE_SINK_FEEDBACK, h.code, h.bytes,
+                             u->recv_buf + sizeof(h), msg_bytes - sizeof(h));
+            if (h.code == XRDP_SINK_CODE_QUEUED && msg_bytes >= sizeof(h) + 4) {
+                memcpy(&queued, u->recv_buf + sizeof(h), 4);
+                XRDP_TRACE(&u->trace, XRDP_TRACE_FEEDBACK, queued);
+                if (queued == 0 && u->chansrv_queued > 0) {
+                    /* the client ran dry */
+                    u->adapt_events++;
+                    u->stats.underruns++;
+                }
+                u->chansrv_queued = queued;
+                if (u->rate_start == 0) {
+                    u->rate_start = pa_rtclock_now();
+                }
+            } else if (h.code == XRDP_SINK_CODE_CAPS && msg_bytes >= sizeof(h) + 8) {
+                memcpy(caps, u->recv_buf + sizeof(h), 8);
+                if (wire_negotiate(u, caps[0], caps[1]) != 0) {
+                    return -1;
+                }
+            } else {
+                pa_log_debug("data_read_feedback: ignoring code %d", h.code);
+            }
+            u->recv_len -= msg_bytes;
+            memmove(u->recv_buf, u->recv_buf + msg_bytes, u->recv_len);
         }
-        sent += error;
     }
-    return sent;
 }
 
-static int data_send(struct userdata *u, pa_memchunk *chunk) {
-    char *data;
+/* send anything already queued plus the given frames, see
+ * xrdp_send_frames(). Returns the number of frames accepted or -1 if the
+ * connection failed */
+static int send_frames(struct userdata *u, struct xrdp_send_frame *frames, int nframes) {
+    struct pollfd *pollfd;
+    uint64_t sent;
+    int accepted;
+    int i;
+
+    sent = u->stats.bytes_sent;
+    accepted = xrdp_send_frames(u->fd, &u->send_ring, frames, nframes, &u->stats);
+    if (accepted < 0) {
+        return -1;
+    }
+    for (i = 0; i < accepted; i++) {
+        xrdp_capture_add(&u->capture, XRDP_CAPTURE_SINK_FRAME, frames[i].h.code,
+                         frames[i].h.bytes, frames[i].data, frames[i].bytes);
+    }
+    XRDP_TRACE(&u->trace, XRDP_TRACE_SEND, u->stats.bytes_sent - sent);
+    if (accepted < nframes || (nframes > 0 && u->send_ring.len > 0)) {
+        /* dropped frames or chansrv is not keeping up */
+        u->adapt_events++;
+    }
+
+    /* feedback is always read, only wait for the socket to drain while
+     * there is something left over */
+    pollfd = pa_rtpoll_item_get_pollfd(u->rtpoll_item, NULL);
+    pollfd->events = (short) (POLLIN | (u->send_ring.len > 0 ? POLLOUT : 0));
+    pollfd->revents = 0;
+
+    return accepted;
+}
+
+/* write as much of the send ring as the socket takes without blocking,
+ * returns -1 if the connection failed */
+static int data_flush(struct userdata *u) {
+    return send_frames(u, NULL, 0) < 0 ? -1 : 0;
+}
+
+/* hand a new shm ring to a freshly connected chansrv */
+static int shm_setup(struct userdata *u) {
+    struct xrdp_header h;
+
+    if (xrdp_shm_renew(&u->shm) != 0) {
+        return -1;
+    }
+    h.code = XRDP_SINK_CODE_SHM_SETUP;
+    h.bytes = 8;
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SINK_FRAME, h.code, h.bytes, NULL, 0);
+
+    return xrdp_shm_send_fd(u->fd, u->shm.fd, &h, sizeof(h));
+}
+
+#ifdef XRDP_HAVE_OPUS
+/* start a fresh Opus stream and tell chansrv how to decode it */
+static int opus_setup(struct userdata *u) {
+    struct xrdp_send_frame frame;
+    uint32_t params[3];
+
+    opus_encoder_ctl(u->opus, OPUS_RESET_STATE);
+    u->opus_pcm_len = 0;
+
+    params[0] = u->wire_ss.rate;
+    params[1] = u->wire_ss.channels;
+    params[2] = u->opus_frame_bytes / pa_frame_size(&u->wire_ss);
+    frame.h.code = XRDP_SINK_CODE_OPUS_SETUP;
+    frame.h.bytes = sizeof(params) + 8;
+    frame.data = (const char*) params;
+    frame.bytes = sizeof(params);
+
+    return send_frames(u, &frame, 1) == 1 ? 0 : -1;
+}
+
+/* encode rendered PCM into Opus packets of OPUS_FRAME_USEC each, a
+ * trailing partial frame waits for the next call */
+static int data_send_opus(struct userdata *u, pa_memchunk *chunks, int nchunks) {
+    struct xrdp_send_frame frames[MAX_SEND_FRAMES];
+    const char *pcm;
+    const char *in;
+    size_t left;
+    size_t part;
+    opus_int32 len;
+    int nframes;
+    int samples;
     int bytes;
-    int sent;
+    int i;
+
+    samples = u->opus_frame_bytes / pa_frame_size(&u->wire_ss);
+    nframes = 0;
+    bytes = 0;
+    for (i = 0; i < nchunks; i++) {
+        in = (char*)pa_memblock_acquire(chunks[i].memblock) + chunks[i].index;
+        left = chunks[i].length;
+        while (left > 0) {
+            if (u->opus_pcm_len == 0 && left >= u->opus_frame_bytes) {
+                /* whole frame in the memblock, no need to copy */
+                pcm = in;
+                part = u->opus_frame_bytes;
+            } else {
+                part = MIN(left, u->opus_frame_bytes - u->opus_pcm_len);
+                memcpy(u->opus_pcm + u->opus_pcm_len, in, part);
+                u->opus_pcm_len += part;
+                pcm = u->opus_pcm;
+            }
+            in += part;
+            left -= part;
+            if (pcm == u->opus_pcm && u->opus_pcm_len < u->opus_frame_bytes) {
+                break;
+            }
+            u->opus_pcm_len = 0;
+
+            len = opus_encode(u->opus, (const opus_int16*) pcm, samples,
+                              u->opus_packets + nframes * OPUS_MAX_PACKET,
+                              OPUS_MAX_PACKET);
+            if (len < 0) {
+                pa_log("data_send_opus: opus_encode failed: %s",
+                       opus_strerror(len));
+                continue;
+            }
+            frames[nframes].h.code = XRDP_SINK_CODE_OPUS;
+            frames[nframes].h.bytes = len + 8;
+            frames[nframes].data = (const char*) u->opus_packets +
+                                   nframes * OPUS_MAX_PACKET;
+            frames[nframes].bytes = len;
+            nframes++;
+
+            if (nframes == MAX_SEND_FRAMES) {
+                if (send_frames(u, frames, nframes) < 0) {
+                    pa_memblock_release(chunks[i].memblock);
+                    goto fail;
+                }
+                nframes = 0;
+            }
+        }
+        pa_memblock_release(chunks[i].memblock);
+        bytes += chunks[i].length;
+    }
+
+    if (nframes > 0 && send_frames(u, frames, nframes) < 0) {
+        goto fail;
+    }
+
+    return bytes;
+
+fail:
+    pa_log("data_send_opus: send failed");
+    data_close(u);
+    return 0;
+}
+
+/* codec=opus: only S16NE at rates and channel counts Opus supports */
+static int opus_init(struct userdata *u, uint32_t bitrate) {
+    const pa_sample_spec *ss = &u->wire_ss;
+    int error;
+
+    if (ss->format != PA_SAMPLE_S16NE || ss->channels > 2 ||
+        (ss->rate != 8000 && ss->rate != 12000 && ss->rate != 16000 &&
+         ss->rate != 24000 && ss->rate != 48000)) {
+        pa_log("codec=opus needs format=s16ne, channels=1 or 2 and "
+               "rate=8000, 12000, 16000, 24000 or 48000");
+        return -1;
+    }
+
+    u->opus = opus_encoder_create(ss->rate, ss->channels,
+                                  OPUS_APPLICATION_AUDIO, &error);
+    if (u->opus == NULL) {
+        pa_log("opus_encoder_create failed: %s", opus_strerror(error));
+        return -1;
+    }
+    opus_encoder_ctl(u->opus, OPUS_SET_BITRATE(bitrate));
+
+    u->opus_frame_bytes = pa_usec_to_bytes(OPUS_FRAME_USEC, ss);
+    u->opus_pcm = pa_xmalloc(u->opus_frame_bytes);
+    u->opus_packets = pa_xmalloc(MAX_SEND_FRAMES * OPUS_MAX_PACKET);
+
+    return 0;
+}
+#endif /* XRDP_HAVE_OPUS */
+
+static int data_connect(struct userdata *u) {
     int fd;
-    struct header h;
-    struct sockaddr_un s;
+    struct pollfd *pollfd;
 
-    if (u->fd == -1) {
-        if (u->failed_connect_time != 0) {
-            if (pa_rtclock_now() - u->failed_connect_time < 1000000) {
+    if (u->fd != -1) {
+        return 0;
+    }
+    /* the connect runs in the background, see xrdp-connect.c */
+    if ((fd = xrdp_connect_get(&u->conn, pa_rtclock_now())) < 0) {
+        return -1;
+    }
+    u->stats.connects++;
+    pa_make_fd_nonblock(fd);
+    u->fd = fd;
+
+    u->rtpoll_item = pa_rtpoll_item_new(u->rtpoll, PA_RTPOLL_NEVER, 1);
+    pollfd = pa_rtpoll_item_get_pollfd(u->rtpoll_item, NULL);
+    pollfd->fd = fd;
+    pollfd->events = POLLIN;
+    pollfd->revents = 0;
+
+    if (u->shm.hdr && shm_setup(u) != 0) {
+        data_close(u);
+        xrdp_connect_failed(&u->conn, pa_rtclock_now());
+        return -1;
+    }
+
+#ifdef XRDP_HAVE_OPUS
+    if (u->opus && opus_setup(u) != 0) {
+        data_close(u);
+        xrdp_connect_failed(&u->conn, pa_rtclock_now());
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* copy rendered chunks into the shm ring, chansrv only gets a wakeup
+ * frame if it might have gone to sleep on an empty ring */
+static int data_send_shm(struct userdata *u, pa_memchunk *chunks, int nchunks) {
+    struct xrdp_send_frame frame;
+    int was_empty;
+    int bytes;
+    char *data;
+    int i;
+
+    was_empty = xrdp_shm_readable(&u->shm) == 0;
+
+    bytes = 0;
+    for (i = 0; i < nchunks; i++) {
+        if (xrdp_shm_writable(&u->shm) < chunks[i].length) {
+            XRDP_TRACE(&u->trace, XRDP_TRACE_DROP, chunks[i].length);
+            continue;
+        }
+        data = (char*)pa_memblock_acquire(chunks[i].memblock);
+        xrdp_shm_write(&u->shm, data + chunks[i].index, chunks[i].length);
+        pa_memblock_release(chunks[i].memblock);
+        bytes += chunks[i].length;
+    }
+
+    if (bytes > 0 && was_empty) {
+        frame.h.code = XRDP_SINK_CODE_SHM_DATA;
+        frame.h.bytes = 8;
+        frame.data = NULL;
+        frame.bytes = 0;
+        if (send_frames(u, &frame, 1) < 0) {
+            pa_log("data_send_shm: send failed");
+            data_close(u);
+            return 0;
+        }
+    }
+
+    return bytes;
+}
+
+/* true if no sample in 'data' exceeds the threshold. The loops are kept
+ * branch free within a block so the compiler can vectorize them */
+static int is_silence(const char *data, size_t bytes,
+                      const pa_sample_spec *ss, int threshold) {
+    size_t i;
+    size_t j;
+    size_t n;
+
+    if (ss->format == PA_SAMPLE_S16NE && threshold > 0) {
+        const int16_t *s = (const int16_t *) data;
+        int peak = 0;
+
+        n = bytes / sizeof(*s);
+        for (i = 0; i < n; i += 256) {
+            for (j = i; j < MIN(i + 256, n); j++) {
+                int v = s[j] < 0 ? -s[j] : s[j];
+                peak = v > peak ? v : peak;
+            }
+            if (peak > threshold) {
                 return 0;
             }
         }
-        fd = socket(PF_LOCAL, SOCK_STREAM, 0);
-        memset(&s, 0, sizeof(s));
-        s.sun_family = AF_UNIX;
-        pa_strlcpy(s.sun_path, u->sink_socket, sizeof(s.sun_path));
-        pa_log_debug("trying to connect to %s", s.sun_path);
-
-        if (connect(fd, (struct sockaddr *)&s,
-                    sizeof(struct sockaddr_un)) != 0) {
-            u->failed_connect_time = pa_rtclock_now();
-            pa_log_debug("Connected failed");
-            close(fd);
+        return 1;
+    }
+
+    if (ss->format == PA_SAMPLE_FLOAT32NE && threshold > 0) {
+        const float *f = (const float *) data;
+        float limit = threshold / 32768.0f;
+        float peak = 0.0f;
+
+        n = bytes / sizeof(*f);
+        for (i = 0; i < n; i += 256) {
+            for (j = i; j < MIN(i + 256, n); j++) {
+                float v = f[j] < 0.0f ? -f[j] : f[j];
+                peak = v > peak ? v : peak;
+            }
+            if (peak > limit) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    /* digital silence is all zero bits, except for the unsigned and
+     * companded formats which we never gate */
+    if (ss->format == PA_SAMPLE_U8 || ss->format == PA_SAMPLE_ALAW ||
+        ss->format == PA_SAMPLE_ULAW) {
+        return 0;
+    }
+    for (i = 0; i < bytes; i += 1024) {
+        uint64_t acc = 0;
+        uint64_t w;
+
+        n = MIN(i + 1024, bytes);
+        for (j = i; j + sizeof(w) <= n; j += sizeof(w)) {
+            memcpy(&w, data + j, sizeof(w));
+            acc |= w;
+        }
+        for (; j < n; j++) {
+            acc |= (unsigned char) data[j];
+        }
+        if (acc != 0) {
             return 0;
         }
-        u->failed_connect_time = 0;
-        pa_log("Connected ok fd %d", fd);
-        u->fd = fd;
     }
+    return 1;
+}
 
-    bytes = chunk->length;
-    pa_log_debug("bytes %d", bytes);
+/* send PCM chunks, each in its own frame with the given code, straight
+ * from the memblocks with a single syscall */
+static int data_send_pcm(struct userdata *u, pa_memchunk *chunks, int nchunks,
+                         int code) {
+    struct xrdp_send_frame frames[MAX_SEND_FRAMES];
+    int accepted;
+    int bytes;
+    int i;
+
+    for (i = 0; i < nchunks; i++) {
+        frames[i].h.code = code;
+        frames[i].h.bytes = chunks[i].length + 8;
+        frames[i].data = (char*)pa_memblock_acquire(chunks[i].memblock) +
+                         chunks[i].index;
+        frames[i].bytes = chunks[i].length;
+    }
+
+    accepted = send_frames(u, frames, nchunks);
+
+    bytes = 0;
+    for (i = 0; i < nchunks; i++) {
+        pa_memblock_release(chunks[i].memblock);
+        if (i < accepted) {
+            bytes += chunks[i].length;
+        }
+    }
 
-    h.code = 0;
-    h.bytes = bytes + 8;
-    if (lsend(u->fd, (char*)(&h), 8) != 8) {
+    if (accepted < 0) {
         pa_log("data_send: send failed");
-        close(u->fd);
-        u->fd = -1;
+        data_close(u);
         return 0;
-    } else {
-        pa_log_debug("data_send: sent header ok bytes %d", bytes);
     }
 
-    data = (char*)pa_memblock_acquire(chunk->memblock);
-    data += chunk->index;
-    sent = lsend(u->fd, data, bytes);
-    pa_memblock_release(chunk->memblock);
+    return bytes;
+}
 
-    if (sent != bytes) {
-        pa_log("data_send: send failed sent %d bytes %d", sent, bytes);
-        close(u->fd);
-        u->fd = -1;
+/* send rendered chunks of the main sink in whatever the transport and
+ * codec want */
+static int data_send_chunks(struct userdata *u, pa_memchunk *chunks, int nchunks) {
+    if (u->shm.hdr) {
+        return data_send_shm(u, chunks, nchunks);
+    }
+#ifdef XRDP_HAVE_OPUS
+    if (u->opus) {
+        return data_send_opus(u, chunks, nchunks);
+    }
+#endif
+    return data_send_pcm(u, chunks, nchunks, XRDP_SINK_CODE_DATA);
+}
+
+/* send a run of gated chunks as one silence frame */
+static int data_send_silence(struct userdata *u, size_t bytes) {
+    struct xrdp_send_frame frame;
+    uint32_t silent_bytes = bytes;
+
+    frame.h.code = XRDP_SINK_CODE_SILENCE;
+    frame.h.bytes = sizeof(silent_bytes) + 8;
+    frame.data = (const char*) &silent_bytes;
+    frame.bytes = sizeof(silent_bytes);
+    if (send_frames(u, &frame, 1) < 0) {
+        pa_log("data_send_silence: send failed");
+        data_close(u);
+        return 0;
+    }
+    return bytes;
+}
+
+/* convert rendered chunks to the wire format, all of them land in one
+ * reused memblock */
+static void convert_chunks(struct userdata *u, pa_memchunk *chunks, int nchunks,
+                           pa_memchunk *converted) {
+    size_t total;
+    size_t offset;
+    char *dst;
+    char *src;
+    int i;
+
+    total = 0;
+    for (i = 0; i < nchunks; i++) {
+        total += xrdp_convert_out_bytes(&u->conv, chunks[i].length);
+    }
+
+    if (u->convert_memblock &&
+        (!pa_memblock_ref_is_one(u->convert_memblock) ||
+         pa_memblock_get_length(u->convert_memblock) < total)) {
+        pa_memblock_unref(u->convert_memblock);
+        u->convert_memblock = NULL;
+    }
+    if (u->convert_memblock == NULL) {
+        u->convert_memblock = pa_memblock_new(u->core->mempool, total);
+    }
+
+    dst = (char*)pa_memblock_acquire(u->convert_memblock);
+    offset = 0;
+    for (i = 0; i < nchunks; i++) {
+        src = (char*)pa_memblock_acquire(chunks[i].memblock) + chunks[i].index;
+        xrdp_convert_run(&u->conv, dst + offset, src, chunks[i].length);
+        pa_memblock_release(chunks[i].memblock);
+
+        converted[i].memblock = u->convert_memblock;
+        converted[i].index = offset;
+        converted[i].length = xrdp_convert_out_bytes(&u->conv, chunks[i].length);
+        offset += converted[i].length;
+    }
+    pa_memblock_release(u->convert_memblock);
+}
+
+/* returns the number of wire format bytes taken */
+static int data_send(struct userdata *u, pa_memchunk *chunks, int nchunks) {
+    pa_memchunk converted[MAX_SEND_FRAMES];
+    size_t silent_bytes;
+    int start;
+    int bytes;
+    int silent;
+    int i;
+
+    if (data_connect(u) != 0) {
         return 0;
     }
 
-    return sent;
+    if (u->convert) {
+        convert_chunks(u, chunks, nchunks, converted);
+        chunks = converted;
+    }
+
+    if (!u->silence_suppression) {
+        return data_send_chunks(u, chunks, nchunks);
+    }
+
+    /* chunks after the hangover that are silent go out as a byte count,
+     * runs of audio chunks are sent as usual */
+    bytes = 0;
+    start = 0;
+    silent_bytes = 0;
+    for (i = 0; i < nchunks; i++) {
+        const char *data;
+
+        data = (char*)pa_memblock_acquire(chunks[i].memblock) + chunks[i].index;
+        silent = is_silence(data, chunks[i].length, &u->wire_ss,
+                            u->silence_threshold);
+        pa_memblock_release(chunks[i].memblock);
+
+        if (!silent) {
+            u->silence_run = 0;
+        } else if (u->silence_run < u->silence_hangover) {
+            u->silence_run += chunks[i].length;
+            silent = 0;
+        }
+
+        if (silent) {
+            if (i > start) {
+                bytes += data_send_chunks(u, chunks + start, i - start);
+            }
+            silent_bytes += chunks[i].length;
+            start = i + 1;
+        } else if (silent_bytes > 0) {
+            bytes += data_send_silence(u, silent_bytes);
+            silent_bytes = 0;
+        }
+        if (u->fd == -1) {
+            return bytes;
+        }
+    }
+    if (silent_bytes > 0) {
+        bytes += data_send_silence(u, silent_bytes);
+    } else if (nchunks > start) {
+        bytes += data_send_chunks(u, chunks + start, nchunks - start);
+    }
+
+    return bytes;
 }
 
-static int close_send(struct userdata *u) {
-    struct header h;
+static int close_send(struct userdata *u, int code) {
+    struct xrdp_send_frame frame;
 
     pa_log("close_send:");
     if (u->fd == -1) {
         return 0;
     }
-    h.code = 1;
-    h.bytes = 8;
-    if (lsend(u->fd, (char*)(&h), 8) != 8) {
+
+    /* the ring may hold the rest of a frame chansrv has started reading,
+     * dropping queued audio would break the framing. A closed connection
+     * stops the stream just as well */
+    if (xrdp_send_ring_space(&u->send_ring) < sizeof(frame.h)) {
+        pa_log("close_send: send ring full, closing the connection");
+        data_close(u);
+        return 0;
+    }
+
+    frame.h.code = code;
+    frame.h.bytes = 8;
+    frame.data = NULL;
+    frame.bytes = 0;
+    if (send_frames(u, &frame, 1) != 1) {
         pa_log("close_send: send failed");
-        close(u->fd);
-        u->fd = -1;
+        data_close(u);
         return 0;
     } else {
         pa_log_debug("close_send: sent header ok");
@@ -480,24 +1511,217 @@ static int close_send(struct userdata *u) {
     return 8;
 }
 
-static void process_render(struct userdata *u, pa_usec_t now) {
+/* render everything due this wakeup into one pooled memblock and send it
+ * as a single frame */
+static void process_render_batch(struct userdata *u, pa_usec_t now) {
+    pa_memchunk chunk;
+    size_t request_bytes;
+    size_t frame_size;
+
+    frame_size = pa_frame_size(&u->sink->sample_spec);
+    while (u->timestamp < now + u->block_usec) {
+        request_bytes = pa_usec_to_bytes(now + u->block_usec - u->timestamp,
+                                         &u->sink->sample_spec);
+        request_bytes = MIN(request_bytes, u->batch_bytes);
+        request_bytes = MAX(request_bytes, frame_size);
+
+        /* someone else still holds the last block, start a new one */
+        if (u->batch_memblock && !pa_memblock_ref_is_one(u->batch_memblock)) {
+            pa_memblock_unref(u->batch_memblock);
+            u->batch_memblock = NULL;
+        }
+        if (u->batch_memblock == NULL) {
+            u->batch_memblock = pa_memblock_new(u->core->mempool, u->batch_bytes);
+        }
+
+        chunk.memblock = u->batch_memblock;
+        chunk.index = 0;
+        chunk.length = request_bytes;
+        pa_sink_render_into_full(u->sink, &chunk);
+        if (u->sink->thread_info.state == PA_SINK_RUNNING) {
+            data_send(u, &chunk, 1);
+        }
+        u->timestamp += render_usec(u, chunk.length);
+    }
+}
+
+/* send held audio beyond hold_bytes, or drop it while the sink is idle */
+static void hold_send(struct userdata *u) {
+    pa_memchunk chunks[MAX_SEND_FRAMES];
+    pa_memblock *block;
+    size_t piece;
+    size_t bytes;
+    char *data;
+    int nchunks;
+
+    piece = u->batch_bytes > 0 ? u->batch_bytes : HOLD_SEND_BYTES;
+    piece = pa_frame_align(piece, &u->sink->sample_spec);
+    while (u->hold.len > u->hold_bytes) {
+        bytes = MIN(u->hold.len - u->hold_bytes, piece * MAX_SEND_FRAMES);
+        bytes = MIN(bytes, pa_mempool_block_size_max(u->core->mempool));
+        if (u->sink->thread_info.state != PA_SINK_RUNNING) {
+            xrdp_send_ring_consume(&u->hold, bytes);
+            continue;
+        }
+
+        block = pa_memblock_new(u->core->mempool, bytes);
+        data = (char*)pa_memblock_acquire(block);
+        xrdp_send_ring_read(&u->hold, data, bytes);
+        pa_memblock_release(block);
+
+        for (nchunks = 0; bytes > 0; nchunks++) {
+            chunks[nchunks].memblock = block;
+            chunks[nchunks].index = nchunks * piece;
+            chunks[nchunks].length = MIN(bytes, piece);
+            bytes -= chunks[nchunks].length;
+        }
+        data_send(u, chunks, nchunks);
+        pa_memblock_unref(block);
+    }
+}
+
+/* rewind_msec: render hold_usec further ahead into the hold ring and only
+ * send what falls out of it, so the same amount is on the wire as without
+ * the hold ring */
+static void process_render_hold(struct userdata *u, pa_usec_t now) {
     pa_memchunk chunk;
+    size_t request_bytes;
+    char *data;
+
+    while (u->timestamp < now + u->block_usec + u->hold_usec) {
+        request_bytes = MIN(u->sink->thread_info.max_request, HOLD_SEND_BYTES);
+        if (xrdp_send_ring_space(&u->hold) < request_bytes) {
+            hold_send(u);
+        }
+        request_bytes = MIN(request_bytes, xrdp_send_ring_space(&u->hold));
+        request_bytes = pa_frame_align(request_bytes, &u->sink->sample_spec);
+        pa_sink_render(u->sink, request_bytes, &chunk);
+        XRDP_TRACE(&u->trace, XRDP_TRACE_RENDER, chunk.length);
+        data = (char*)pa_memblock_acquire(chunk.memblock);
+        xrdp_send_ring_write(&u->hold, data + chunk.index, chunk.length);
+        pa_memblock_release(chunk.memblock);
+        pa_memblock_unref(chunk.memblock);
+        u->timestamp += render_usec(u, chunk.length);
+    }
+    hold_send(u);
+}
+
+static void process_render(struct userdata *u, pa_usec_t now) {
+    pa_memchunk chunks[MAX_SEND_FRAMES];
+    int nchunks;
     int request_bytes;
+    int i;
 
     pa_assert(u);
-    pa_log_debug("process_render: u->block_usec %llu", (unsigned long long) u->block_usec);
+    if (u->hold.buf) {
+        process_render_hold(u, now);
+        return;
+    }
+    if (u->batch_bytes > 0) {
+        process_render_batch(u, now);
+        return;
+    }
     while (u->timestamp < now + u->block_usec) {
-        request_bytes = u->sink->thread_info.max_request;
-        request_bytes = MIN(request_bytes, 16 * 1024);
-        pa_sink_render(u->sink, request_bytes, &chunk);
+        /* pack everything rendered this round into one write */
+        nchunks = 0;
+        while (nchunks < MAX_SEND_FRAMES && u->timestamp < now + u->block_usec) {
+            request_bytes = u->sink->thread_info.max_request;
+            request_bytes = MIN(request_bytes, 16 * 1024);
+            pa_sink_render(u->sink, request_bytes, &chunks[nchunks]);
+            XRDP_TRACE(&u->trace, XRDP_TRACE_RENDER, chunks[nchunks].length);
+            u->timestamp += render_usec(u, chunks[nchunks].length);
+            nchunks++;
+        }
         if (u->sink->thread_info.state == PA_SINK_RUNNING) {
-            data_send(u, &chunk);
+            data_send(u, chunks, nchunks);
+        }
+        for (i = 0; i < nchunks; i++) {
+            pa_memblock_unref(chunks[i].memblock);
         }
-        pa_memblock_unref(chunk.memblock);
-        u->timestamp += pa_bytes_to_usec(chunk.length, &u->sink->sample_spec);
     }
 }
 
+/* low_latency_sink: render its short blocks and send them as DATA_LL,
+ * this runs before the main sink so they go out first */
+static void process_render_ll(struct userdata *u, pa_usec_t now) {
+    pa_memchunk chunks[MAX_SEND_FRAMES];
+    pa_memchunk converted[MAX_SEND_FRAMES];
+    pa_memchunk *send;
+    size_t request_bytes;
+    int nchunks;
+    int i;
+
+    request_bytes = pa_usec_to_bytes(u->ll_block_usec, &u->ll_sink->sample_spec);
+    while (u->ll_timestamp < now + u->ll_block_usec) {
+        nchunks = 0;
+        while (nchunks < MAX_SEND_FRAMES && u->ll_timestamp < now + u->ll_block_usec) {
+            pa_sink_render(u->ll_sink, request_bytes, &chunks[nchunks]);
+            XRDP_TRACE(&u->trace, XRDP_TRACE_RENDER, chunks[nchunks].length);
+            u->ll_timestamp += render_usec(u, chunks[nchunks].length);
+            nchunks++;
+        }
+        if (u->ll_sink->thread_info.state == PA_SINK_RUNNING &&
+            data_connect(u) == 0) {
+            send = chunks;
+            if (u->convert) {
+                convert_chunks(u, chunks, nchunks, converted);
+                send = converted;
+            }
+            data_send_pcm(u, send, nchunks, XRDP_SINK_CODE_DATA_LL);
+            u->ll_open = u->fd >= 0;
+        }
+        for (i = 0; i < nchunks; i++) {
+            pa_memblock_unref(chunks[i].memblock);
+        }
+    }
+}
+
+/* let the main thread see the current state, no syscalls here */
+static void snapshot_publish(struct userdata *u, pa_usec_t now) {
+    struct xrdp_snapshot_data d;
+
+    d.time = now;
+    d.timestamp = u->timestamp;
+    d.downstream_usec = u->downstream_usec;
+    d.queued_bytes = u->send_ring.len;
+    d.chansrv_queued_bytes = u->chansrv_queued;
+    d.stats = u->stats;
+    xrdp_snapshot_write(&u->snapshot, &d);
+}
+
+/* main thread: changed stats from the snapshot go into the proplist,
+ * the IO thread is not involved */
+static void stats_timer_cb(pa_mainloop_api *a, pa_time_event *e,
+                           const struct timeval *tv, void *userdata) {
+    struct userdata *u = userdata;
+    struct xrdp_snapshot_data d;
+    pa_proplist *pl;
+    pa_usec_t now;
+
+    UNUSED_VAR(a);
+    UNUSED_VAR(tv);
+
+    now = pa_rtclock_now();
+    pa_core_rttime_restart(u->core, e, now + STATS_PUBLISH_USEC);
+    xrdp_snapshot_read(&u->snapshot, &d);
+    if (!PA_SINK_IS_LINKED(u->sink->state) ||
+        memcmp(&d.stats, &u->stats_published, sizeof(d.stats)) == 0) {
+        return;
+    }
+    u->stats_published = d.stats;
+
+    pl = pa_proplist_new();
+    xrdp_stats_to_proplist(&d.stats, pl);
+    pa_proplist_setf(pl, "xrdp.stats.latency_usec", "%llu",
+                     (unsigned long long) xrdp_snapshot_latency(&d, now));
+    pa_proplist_setf(pl, "xrdp.stats.queued_bytes", "%llu",
+                     (unsigned long long) d.queued_bytes);
+    pa_proplist_setf(pl, "xrdp.stats.chansrv_queued_bytes", "%llu",
+                     (unsigned long long) d.chansrv_queued_bytes);
+    pa_sink_update_proplist(u->sink, PA_UPDATE_REPLACE, pl);
+    pa_proplist_free(pl);
+}
+
 static void thread_func(void *userdata) {
 
     struct userdata *u = userdata;
@@ -507,27 +1731,75 @@ static void thread_func(void *userdata) {
     pa_log_debug("Thread starting up");
 
     pa_thread_mq_install(&u->thread_mq);
+    xrdp_set_timer_slack(u->timer_slack_usec);
+    xrdp_sched_apply(&u->sched, &u->stats);
 
     u->timestamp = pa_rtclock_now();
 
     for (;;) {
         pa_usec_t now = 0;
+        pa_usec_t deadline = 0;
+        int ll_opened;
+        int opened;
         int ret;
 
-        if (PA_SINK_IS_OPENED(u->sink->thread_info.state)) {
+        ll_opened = u->ll_sink && PA_SINK_IS_OPENED(u->ll_sink->thread_info.state);
+        opened = PA_SINK_IS_OPENED(u->sink->thread_info.state);
+        if (opened || ll_opened) {
             now = pa_rtclock_now();
         }
+        if (u->keep_warm) {
+            if (u->sink->thread_info.state == PA_SINK_IDLE) {
+                if (!u->parked) {
+                    /* get the connect going so resuming does not wait */
+                    data_connect(u);
+                    u->parked = 1;
+                }
+                opened = 0;
+            } else if (u->parked && opened) {
+                /* render the first block right away */
+                u->timestamp = now;
+                latency_reset(u, now);
+                u->parked = 0;
+            }
+        }
         if (PA_UNLIKELY(u->sink->thread_info.rewind_requested)) {
-            process_rewind(u, now);
+            process_rewind(u);
+        }
+        if (u->ll_sink && PA_UNLIKELY(u->ll_sink->thread_info.rewind_requested)) {
+            pa_sink_process_rewind(u->ll_sink, 0);
+        }
+        if (ll_opened) {
+            if (u->ll_timestamp <= now) {
+                process_render_ll(u, now);
+            }
+            deadline = u->ll_timestamp;
         }
         /* Render some data and write it to the socket */
-        if (PA_SINK_IS_OPENED(u->sink->thread_info.state)) {
+        if (opened) {
             if (u->timestamp <= now) {
+                if (u->timestamp + u->block_usec < now &&
+                    u->sink->thread_info.state == PA_SINK_RUNNING) {
+                    /* woke up more than a block late, chansrv ran dry */
+                    u->stats.underruns++;
+                }
                 process_render(u, now);
+                xrdp_stats_add_process(&u->stats, pa_rtclock_now() - now);
+                latency_update(u, now);
+                adapt_block(u, now);
+                rate_update(u, now);
             }
-            pa_rtpoll_set_timer_absolute(u->rtpoll, u->timestamp);
+            if (deadline == 0 || u->timestamp < deadline) {
+                deadline = u->timestamp;
+            }
+        }
+        if (deadline != 0) {
+            pa_rtpoll_set_timer_absolute(u->rtpoll, deadline);
+            u->timer_deadline = deadline;
+            snapshot_publish(u, now);
         } else {
             pa_rtpoll_set_timer_disabled(u->rtpoll);
+            u->timer_deadline = 0;
         }
 
         /* Hmm, nothing to do. Let's sleep */
@@ -542,6 +1814,42 @@ static void thread_func(void *userdata) {
         if (ret == 0) {
             goto finish;
         }
+
+        if (u->timer_deadline != 0) {
+            pa_usec_t woke = pa_rtclock_now();
+
+            if (woke >= u->timer_deadline) {
+                xrdp_stats_add_jitter(&u->stats, woke - u->timer_deadline);
+                XRDP_TRACE(&u->trace, XRDP_TRACE_WAKEUP, woke - u->timer_deadline);
+            }
+        }
+
+        xrdp_connect_process(&u->conn);
+
+        /* read feedback and resume a partial write once chansrv has
+         * drained the socket */
+        if (u->rtpoll_item) {
+            struct pollfd *pollfd;
+            short revents;
+
+            pollfd = pa_rtpoll_item_get_pollfd(u->rtpoll_item, NULL);
+            revents = pollfd->revents;
+            if (revents & (POLLERR | POLLNVAL)) {
+                pa_log("chansrv connection error");
+                data_close(u);
+            } else {
+                /* a hangup shows up as end of file here */
+                if ((revents & (POLLIN | POLLHUP)) && data_read_feedback(u) != 0) {
+                    data_close(u);
+                }
+                if (u->fd >= 0 && (revents & POLLOUT) && data_flush(u) != 0) {
+                    data_close(u);
+                }
+                if (u->fd >= 0 && (revents & POLLIN)) {
+                    latency_update(u, pa_rtclock_now());
+                }
+            }
+        }
     }
 fail:
     /* If this was no regular exit from the loop we have to continue
@@ -555,35 +1863,6 @@ finish:
     pa_log_debug("Thread shutting down");
 }
 
-static void set_sink_socket(pa_modargs *ma, struct userdata *u) {
-    const char *socket_dir;
-    const char *socket_name;
-    char default_socket_name[64];
-    size_t nbytes;
-
-    socket_dir = pa_modargs_get_value(ma, "xrdp_socket_path",
-                                      getenv("XRDP_SOCKET_PATH"));
-    if (socket_dir == NULL || socket_dir[0] == '\0') {
-        socket_dir = "/tmp/.xrdp";
-    }
-
-    socket_name = pa_modargs_get_value(ma, "xrdp_pulse_sink_socket",
-                                       getenv("XRDP_PULSE_SINK_SOCKET"));
-    if (socket_name == NULL || socket_name[0] == '\0')
-    {
-        int display_num = get_display_num_from_display(getenv("DISPLAY"));
-
-        pa_log_debug("Could not obtain sink_socket from environment.");
-        snprintf(default_socket_name, sizeof(default_socket_name),
-                 "xrdp_chansrv_audio_out_socket_%d", display_num);
-        socket_name = default_socket_name;
-    }
-
-    nbytes = strlen(socket_dir) + 1 + strlen(socket_name) + 1;
-    u->sink_socket = pa_xmalloc(nbytes);
-    snprintf(u->sink_socket, nbytes, "%s/%s", socket_dir, socket_name);
-}
-
 int pa__init(pa_module*m) {
     struct userdata *u = NULL;
     pa_device_port *port;
@@ -593,6 +1872,27 @@ int pa__init(pa_module*m) {
     pa_modargs *ma = NULL;
     pa_sink_new_data data;
     size_t nbytes;
+    uint32_t batch_bytes = 0;
+    size_t max_batch;
+    const char *transport;
+    const char *codec;
+    uint32_t opus_bitrate = DEFAULT_OPUS_BITRATE;
+    pa_bool_t wire_conversion = FALSE;
+    pa_bool_t silence_suppression = FALSE;
+    uint32_t silence_threshold = 0;
+    uint32_t silence_hangover_msec = DEFAULT_SILENCE_HANGOVER_MSEC;
+    uint32_t min_latency_msec;
+    uint32_t max_latency_msec = BLOCK_USEC / PA_USEC_PER_MSEC;
+    uint32_t rewind_msec = 0;
+    uint32_t timer_slack_usec = DEFAULT_TIMER_SLACK_USEC;
+    pa_bool_t rate_control = TRUE;
+    uint32_t target_queue_msec = 0;
+    pa_bool_t keep_warm = FALSE;
+    const char *capture_file;
+    pa_bool_t capture_payload = FALSE;
+    uint32_t capture_max_mb = DEFAULT_CAPTURE_MAX_MB;
+    const char *ll_name;
+    uint32_t ll_max_msec = DEFAULT_LL_MAX_LATENCY_MSEC;
 
     pa_assert(m);
 
@@ -623,9 +1923,27 @@ int pa__init(pa_module*m) {
     m->userdata = u = pa_xnew0(struct userdata, 1);
     u->core = m->core;
     u->module = m;
+    u->shm.fd = -1;
     u->rtpoll = pa_rtpoll_new();
     pa_thread_mq_init(&u->thread_mq, m->core->mainloop, u->rtpoll);
 
+    /* without min_latency_msec the block size stays at the maximum */
+    if (pa_modargs_get_value_u32(ma, "max_latency_msec", &max_latency_msec) < 0 ||
+        max_latency_msec == 0) {
+        pa_log("Failed to parse max_latency_msec value.");
+        goto fail;
+    }
+    min_latency_msec = max_latency_msec;
+    if (pa_modargs_get_value_u32(ma, "min_latency_msec", &min_latency_msec) < 0 ||
+        min_latency_msec == 0 || min_latency_msec > max_latency_msec) {
+        pa_log("Failed to parse min_latency_msec value.");
+        goto fail;
+    }
+    u->min_latency_usec = min_latency_msec * PA_USEC_PER_MSEC;
+    u->max_latency_usec = max_latency_msec * PA_USEC_PER_MSEC;
+    u->requested_usec = u->max_latency_usec;
+    u->adapt_usec = u->max_latency_usec;
+
     pa_sink_new_data_init(&data);
     data.driver = __FILE__;
     data.module = m;
@@ -637,6 +1955,8 @@ int pa__init(pa_module*m) {
     pa_proplist_sets(data.proplist, PA_PROP_DEVICE_CLASS, "sound");
     pa_proplist_sets(data.proplist, PA_PROP_DEVICE_FORM_FACTOR, "computer");
     pa_proplist_sets(data.proplist, PA_PROP_DEVICE_PRODUCT_NAME, "xrdp");
+    pa_proplist_setf(data.proplist, "xrdp.block_usec", "%llu",
+                     (unsigned long long) u->max_latency_usec);
 
 
     if (pa_modargs_get_proplist(ma, "sink_properties", data.proplist,
@@ -645,17 +1965,18 @@ int pa__init(pa_module*m) {
         pa_sink_new_data_done(&data);
         goto fail;
     }
-    port = xrdp_create_port(u);
+    port = xrdp_create_port(u->core, "xrdp-output", "xrdp output",
+                            PA_DIRECTION_OUTPUT);
     if (port == NULL) {
         pa_log("Failed to create port object");
         goto fail;
     }
 
-    profile = xrdp_create_profile();
+    profile = xrdp_create_profile(ss.channels);
 
     pa_hashmap_put(port->profiles, profile->name, profile);
 
-    u->card = xrdp_create_card(m, port, profile);
+    u->card = xrdp_create_card(m, __FILE__, "xrdp.sink", port, profile);
     if (u->card == NULL) {
         pa_log("Failed to create card object");
         goto fail;
@@ -683,15 +2004,215 @@ int pa__init(pa_module*m) {
     pa_sink_set_asyncmsgq(u->sink, u->thread_mq.inq);
     pa_sink_set_rtpoll(u->sink, u->rtpoll);
 
-    u->block_usec = BLOCK_USEC;
+    u->block_usec = u->max_latency_usec;
     pa_log_debug("3 block_usec %llu", (unsigned long long) u->block_usec);
     nbytes = pa_usec_to_bytes(u->block_usec, &u->sink->sample_spec);
-    pa_sink_set_max_rewind(u->sink, nbytes);
+
+    if (pa_modargs_get_value_u32(ma, "rewind_msec", &rewind_msec) < 0) {
+        pa_log("Failed to parse rewind_msec value.");
+        goto fail;
+    }
+    if (rewind_msec > 0) {
+        u->hold_usec = rewind_msec * PA_USEC_PER_MSEC;
+        u->hold_bytes = pa_usec_to_bytes(u->hold_usec, &u->sink->sample_spec);
+        xrdp_send_ring_init(&u->hold, u->hold_bytes + 2 * HOLD_SEND_BYTES);
+    }
+    pa_sink_set_max_rewind(u->sink, u->hold_bytes);
     pa_sink_set_max_request(u->sink, nbytes);
 
-    set_sink_socket(ma, u);
+    xrdp_trace_init(&u->trace, pa_modargs_get_value(ma, "trace_file", NULL));
+    if (xrdp_sched_parse(&u->sched, ma, m->core) != 0) {
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_u32(ma, "timer_slack_usec", &timer_slack_usec) < 0) {
+        pa_log("Failed to parse timer_slack_usec value.");
+        goto fail;
+    }
+    u->timer_slack_usec = timer_slack_usec;
+
+    if (pa_modargs_get_value_boolean(ma, "rate_control", &rate_control) < 0) {
+        pa_log("Failed to parse rate_control value.");
+        goto fail;
+    }
+    if (pa_modargs_get_value_u32(ma, "target_queue_msec", &target_queue_msec) < 0) {
+        pa_log("Failed to parse target_queue_msec value.");
+        goto fail;
+    }
+    u->rate_control = rate_control;
+    u->rate_target_cfg = target_queue_msec * PA_USEC_PER_MSEC;
+    rate_reset(u);
+
+    if (pa_modargs_get_value_boolean(ma, "keep_warm", &keep_warm) < 0) {
+        pa_log("Failed to parse keep_warm value.");
+        goto fail;
+    }
+    u->keep_warm = keep_warm;
+
+    if (pa_modargs_get_value_u32(ma, "batch_bytes", &batch_bytes) < 0) {
+        pa_log("Failed to parse batch_bytes value.");
+        goto fail;
+    }
+    if (batch_bytes > 0) {
+        u->batch_bytes = MIN(batch_bytes,
+                             pa_mempool_block_size_max(m->core->mempool));
+        u->batch_bytes = pa_frame_align(u->batch_bytes, &u->sink->sample_spec);
+        u->batch_bytes = MAX(u->batch_bytes, pa_frame_size(&u->sink->sample_spec));
+        pa_log_debug("batching up to %lu bytes per frame",
+                     (unsigned long) u->batch_bytes);
+    }
+
+    if (pa_modargs_get_value_boolean(ma, "wire_conversion", &wire_conversion) < 0) {
+        pa_log("Failed to parse wire_conversion value.");
+        goto fail;
+    }
+    /* chansrv wants S16 stereo unless it sends caps */
+    u->wire_conversion = wire_conversion;
+    if (wire_setup(u, wire_default_channels(u)) != 0) {
+        pa_log("Failed to set up wire format conversion");
+        goto fail;
+    }
+
+    transport = pa_modargs_get_value(ma, "transport", "socket");
+    if (strcmp(transport, "memfd") == 0) {
+        if (xrdp_shm_create(&u->shm, "xrdp-sink",
+                            pa_usec_to_bytes(SEND_RING_USEC,
+                                             &u->sink->sample_spec)) != 0) {
+            pa_log("Failed to set up memfd transport");
+            goto fail;
+        }
+    } else if (strcmp(transport, "socket") != 0) {
+        pa_log("Invalid transport '%s', expected socket or memfd", transport);
+        goto fail;
+    }
+
+    codec = pa_modargs_get_value(ma, "codec", "pcm");
+    if (pa_modargs_get_value_u32(ma, "opus_bitrate", &opus_bitrate) < 0) {
+        pa_log("Failed to parse opus_bitrate value.");
+        goto fail;
+    }
+    if (strcmp(codec, "opus") == 0) {
+#ifdef XRDP_HAVE_OPUS
+        if (u->shm.hdr) {
+            pa_log("codec=opus needs transport=socket");
+            goto fail;
+        }
+        if (opus_init(u, opus_bitrate) != 0) {
+            goto fail;
+        }
+#else
+        pa_log("codec=opus is not available, built without Opus support");
+        goto fail;
+#endif
+    } else if (strcmp(codec, "pcm") != 0) {
+        pa_log("Invalid codec '%s', expected pcm or opus", codec);
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_boolean(ma, "silence_suppression",
+                                     &silence_suppression) < 0 ||
+        pa_modargs_get_value_u32(ma, "silence_threshold", &silence_threshold) < 0 ||
+        pa_modargs_get_value_u32(ma, "silence_hangover_msec",
+                                 &silence_hangover_msec) < 0) {
+        pa_log("Failed to parse silence suppression values.");
+        goto fail;
+    }
+    if (silence_suppression) {
+        /* silence frames can't be ordered against data in the shm ring */
+        if (u->shm.hdr) {
+            pa_log("silence_suppression needs transport=socket");
+            goto fail;
+        }
+        u->silence_suppression = 1;
+        u->silence_threshold = MIN(silence_threshold, 32767);
+        u->silence_hangover_usec = silence_hangover_msec * PA_USEC_PER_MSEC;
+        u->silence_hangover = pa_usec_to_bytes(u->silence_hangover_usec, &u->wire_ss);
+    }
+
+    ll_name = pa_modargs_get_value(ma, "low_latency_sink", NULL);
+    if (ll_name && *ll_name) {
+        if (pa_modargs_get_value_u32(ma, "low_latency_msec", &ll_max_msec) < 0 ||
+            ll_max_msec * PA_USEC_PER_MSEC < LL_MIN_LATENCY_USEC) {
+            pa_log("Failed to parse low_latency_msec value.");
+            goto fail;
+        }
+        /* DATA_LL frames carry PCM on the socket */
+        if (u->shm.hdr) {
+            pa_log("low_latency_sink needs transport=socket");
+            goto fail;
+        }
+#ifdef XRDP_HAVE_OPUS
+        if (u->opus) {
+            pa_log("low_latency_sink needs codec=pcm");
+            goto fail;
+        }
+#endif
+        pa_sink_new_data_init(&data);
+        data.driver = __FILE__;
+        data.module = m;
+        pa_sink_new_data_set_name(&data, ll_name);
+        pa_sink_new_data_set_sample_spec(&data, &ss);
+        pa_sink_new_data_set_channel_map(&data, &map);
+        pa_proplist_sets(data.proplist, PA_PROP_DEVICE_DESCRIPTION,
+                         "remote audio output, low latency");
+        pa_proplist_sets(data.proplist, PA_PROP_DEVICE_CLASS, "sound");
+        pa_proplist_sets(data.proplist, PA_PROP_DEVICE_PRODUCT_NAME, "xrdp");
+        u->ll_sink = pa_sink_new(m->core, &data,
+                                 PA_SINK_LATENCY | PA_SINK_DYNAMIC_LATENCY | PA_SINK_NETWORK);
+        pa_sink_new_data_done(&data);
+        if (!u->ll_sink) {
+            pa_log("Failed to create low latency sink object.");
+            goto fail;
+        }
+        u->ll_sink->parent.process_msg = ll_sink_process_msg;
+#ifdef USE_SET_STATE_IN_IO_THREAD_CB
+        u->ll_sink->set_state_in_io_thread = ll_sink_set_state_in_io_thread_cb;
+#endif
+        u->ll_sink->update_requested_latency = ll_sink_update_requested_latency_cb;
+        u->ll_sink->userdata = u;
+        pa_sink_set_asyncmsgq(u->ll_sink, u->thread_mq.inq);
+        pa_sink_set_rtpoll(u->ll_sink, u->rtpoll);
+        u->ll_block_usec = ll_max_msec * PA_USEC_PER_MSEC;
+        pa_sink_set_max_request(u->ll_sink,
+                                pa_usec_to_bytes(u->ll_block_usec, &ss));
+    }
+
+    capture_file = pa_modargs_get_value(ma, "capture_file", NULL);
+    if (pa_modargs_get_value_boolean(ma, "capture_payload", &capture_payload) < 0 ||
+        pa_modargs_get_value_u32(ma, "capture_max_mb", &capture_max_mb) < 0) {
+        pa_log("Failed to parse capture values.");
+        goto fail;
+    }
+    if (capture_file &&
+        xrdp_capture_open(&u->capture, capture_file,
+                          (size_t) capture_max_mb * 1024 * 1024,
+                          capture_payload, &u->wire_ss) != 0) {
+        goto fail;
+    }
+
+    u->sink_socket = xrdp_socket_path(ma, "xrdp_pulse_sink_socket",
+                                      "XRDP_PULSE_SINK_SOCKET",
+                                      "xrdp_chansrv_audio_out_socket_%d");
+    xrdp_connect_init(&u->conn, u->rtpoll, u->sink_socket);
 
     u->fd = -1;
+    u->smoother_base = pa_rtclock_now();
+    u->smoother = pa_smoother_new(SMOOTHER_ADJUST_USEC, SMOOTHER_WINDOW_USEC,
+                                  TRUE, TRUE, 5, u->smoother_base, FALSE);
+    xrdp_send_ring_init(&u->send_ring,
+                   pa_usec_to_bytes(MAX(SEND_RING_USEC, 4 * u->max_latency_usec),
+                                    &u->sink->sample_spec) +
+                   SEND_RING_SLACK);
+    if (u->batch_bytes > 0) {
+        /* a batch the ring can't hold behind a header is dropped whole */
+        max_batch = (u->send_ring.size - sizeof(struct xrdp_header)) /
+                    pa_frame_size(&u->wire_ss) * pa_frame_size(&u->sink->sample_spec);
+        if (u->batch_bytes > max_batch) {
+            pa_log("batch_bytes clamped to %lu to fit the send ring",
+                   (unsigned long) max_batch);
+            u->batch_bytes = max_batch;
+        }
+    }
 
 #if defined(PA_CHECK_VERSION)
 #if PA_CHECK_VERSION(0, 9, 22)
@@ -706,10 +2227,18 @@ int pa__init(pa_module*m) {
         goto fail;
     }
 
-    pa_sink_set_latency_range(u->sink, 0, BLOCK_USEC);
+    pa_sink_set_latency_range(u->sink, 0, u->max_latency_usec);
 
     pa_sink_put(u->sink);
 
+    u->stats_event = pa_core_rttime_new(m->core, pa_rtclock_now() + STATS_PUBLISH_USEC,
+                                        stats_timer_cb, u);
+
+    if (u->ll_sink) {
+        pa_sink_set_latency_range(u->ll_sink, LL_MIN_LATENCY_USEC, u->ll_block_usec);
+        pa_sink_put(u->ll_sink);
+    }
+
     pa_modargs_free(ma);
 
     return 0;
@@ -730,7 +2259,8 @@ int pa__get_n_used(pa_module *m) {
     pa_assert(m);
     pa_assert_se(u = m->userdata);
 
-    return pa_sink_linked_by(u->sink);
+    return pa_sink_linked_by(u->sink) +
+           (u->ll_sink ? pa_sink_linked_by(u->ll_sink) : 0);
 }
 
 void pa__done(pa_module*m) {
@@ -742,9 +2272,16 @@ void pa__done(pa_module*m) {
         return;
     }
 
+    if (u->stats_event) {
+        u->core->mainloop->time_free(u->stats_event);
+    }
+
     if (u->sink) {
         pa_sink_unlink(u->sink);
     }
+    if (u->ll_sink) {
+        pa_sink_unlink(u->ll_sink);
+    }
 
     if (u->thread) {
         pa_asyncmsgq_send(u->thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN,
@@ -757,6 +2294,15 @@ void pa__done(pa_module*m) {
     if (u->sink) {
         pa_sink_unref(u->sink);
     }
+    if (u->ll_sink) {
+        pa_sink_unref(u->ll_sink);
+    }
+
+    if (u->rtpoll_item) {
+        pa_rtpoll_item_free(u->rtpoll_item);
+        u->rtpoll_item = NULL;
+    }
+    xrdp_connect_done(&u->conn);
 
     if (u->rtpoll) {
         pa_rtpoll_free(u->rtpoll);
@@ -773,6 +2319,36 @@ void pa__done(pa_module*m) {
         u->fd = -1;
     }
 
+    if (u->batch_memblock) {
+        pa_memblock_unref(u->batch_memblock);
+    }
+
+#ifdef XRDP_HAVE_OPUS
+    if (u->opus) {
+        opus_encoder_destroy(u->opus);
+    }
+    pa_xfree(u->opus_pcm);
+    pa_xfree(u->opus_packets);
+#endif
+
+    if (u->convert_memblock) {
+        pa_memblock_unref(u->convert_memblock);
+    }
+    xrdp_convert_done(&u->conv);
+
+    if (u->smoother) {
+        pa_smoother_free(u->smoother);
+    }
+
+    xrdp_send_ring_done(&u->hold);
+
+    /* the IO thread is gone */
+    xrdp_trace_dump(&u->trace);
+    xrdp_trace_done(&u->trace);
+    xrdp_capture_close(&u->capture);
+
+    xrdp_shm_destroy(&u->shm);
+    xrdp_send_ring_done(&u->send_ring);
     pa_xfree(u->sink_socket);
     pa_xfree(u);
 }
@@ -28,10 +28,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 
 #include <pulse/rtclock.h>
 #include <pulse/timeval.h>
@@ -57,6 +59,17 @@ typedef bool pa_bool_t;
 #endif
 
 #include "module-xrdp-source-symdef.h"
+#include "xrdp-shm.h"
+#include "xrdp-convert.h"
+#include "xrdp-connect.h"
+#include "xrdp-common.h"
+#include "xrdp-transport.h"
+#include "xrdp-trace.h"
+#include "xrdp-sched.h"
+#include "xrdp-drift.h"
+#include "xrdp-capture.h"
+#include "xrdp-snapshot.h"
+#include "xrdp-jitter.h"
 
 PA_MODULE_AUTHOR("Laxmikant Rashinkar");
 PA_MODULE_DESCRIPTION("xrdp source");
@@ -71,12 +84,86 @@ PA_MODULE_USAGE(
         "description=<description for the source> "
         "latency_time=<latency time in ms> "
         "xrdp_socket_path=<path to XRDP sockets> "
-        "xrdp_pulse_source_socket=<name of source socket>");
+        "xrdp_pulse_source_socket=<name of source socket> "
+        "streaming=<let chansrv push data instead of polling for it> "
+        "transport=<socket or memfd, memfd needs streaming> "
+        "wire_conversion=<convert from S16 stereo in the module> "
+        "trace_file=<dump hot path events here, needs --enable-hotpath-trace> "
+        "max_idle_msec=<poll up to this slowly while chansrv has no data> "
+        "timer_slack_usec=<let poll wakeups be this late to share them> "
+        "sched=<inherit, rtkit, fifo or rr for the IO thread> "
+        "sched_priority=<realtime priority, 1 to 99> "
+        "cpu_affinity=<cpus for the IO thread, like 0-3,8> "
+        "protocol_version=<1, or 2 to offer 32 bit lengths to a chansrv that answers HELLO, default 1> "
+        "drift_compensation=<yes to resample to follow the client's capture clock, default no> "
+        "capture_file=<record the socket traffic to this file> "
+        "capture_payload=<record the audio too, not only message sizes> "
+        "capture_max_mb=<size of the capture file> "
+        "jitter_buffer_msec=<smooth out bursts with this much buffering, 0 for off> "
+        "conceal_msec=<fill gaps in the capture by repeating for up to this long>");
 
 #define DEFAULT_SOURCE_NAME "xrdp-source"
 #define DEFAULT_LATENCY_TIME 10
+#define DEFAULT_MAX_IDLE_MSEC 80
+#define DEFAULT_TIMER_SLACK_USEC 500
+#define DEFAULT_CAPTURE_MAX_MB 64
+#define DEFAULT_JITTER_BUFFER_MSEC 0
+#define DEFAULT_CONCEAL_MSEC 60
+#define DEFAULT_PROTOCOL_VERSION 1
 #define MAX_LATENCY_USEC 1000
 
+/* commands sent to chansrv */
+#define XRDP_SOURCE_CMD_START 1
+#define XRDP_SOURCE_CMD_STOP 2
+#define XRDP_SOURCE_CMD_READ 3
+#define XRDP_SOURCE_CMD_STREAM 4
+#define XRDP_SOURCE_CMD_SHM_SETUP 5 /* memfd attached */
+/* sent once after connecting with protocol_version=2, the parameter is
+ * the version in the low 16 bits and XRDP_SOURCE_CAP_* in the high 16.
+ * chansrv answers with the same message holding what it accepts. An
+ * older chansrv ignores it, so it is only sent when asked for */
+#define XRDP_SOURCE_CMD_HELLO 6
+
+/* all commands carry a 4 byte parameter and every length chansrv sends,
+ * READ replies and stream messages, is 4 bytes */
+#define XRDP_SOURCE_CAP_LEN32 (1 << 0)
+
+#define XRDP_SOURCE_PROTOCOL_VERSION 2
+#define XRDP_SOURCE_CMD_BYTES 11
+#define XRDP_SOURCE_CMD32_BYTES 13
+
+/* how long chansrv gets to answer HELLO */
+#define HELLO_TIMEOUT_MSEC 100
+
+/* largest poll mode backlog fetched with one READ with 32 bit lengths */
+#define MAX_READ_USEC PA_USEC_PER_SEC
+
+/* capture audio the shm ring holds before chansrv has to drop */
+#define SHM_RING_USEC (PA_USEC_PER_SEC / 2)
+
+/* number of capture memblocks kept for reuse */
+#define MEMBLOCK_POOL_SIZE 8
+
+/* how often the main thread puts changed stats into xrdp.stats.* */
+#define STATS_PUBLISH_USEC PA_USEC_PER_SEC
+
+#define UNUSED_VAR(x) ((void) (x))
+
+/* support for the set_state_in_io_thread callback was added in 11.99.1 */
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(11, 99, 1)
+#define USE_SET_STATE_IN_IO_THREAD_CB
+#else
+#undef USE_SET_STATE_IN_IO_THREAD_CB
+#endif
+
+/* fixed size memblocks recycled once PulseAudio has let go of them */
+struct memblock_pool {
+    pa_memblock *blocks[MEMBLOCK_POOL_SIZE];
+    size_t block_size;
+    uint64_t hits;
+    uint64_t misses;
+};
+
 struct userdata {
     pa_core *core;
     pa_module *module;
@@ -94,10 +181,59 @@ struct userdata {
     pa_usec_t timestamp;
     pa_usec_t latency_time;
 
+    /* poll mode wakeups, see poll_adapt() */
+    pa_usec_t poll_usec; /* current poll interval */
+    pa_usec_t max_idle_usec; /* poll_usec backs off up to this */
+    pa_usec_t timer_slack_usec;
+    pa_usec_t slack_set; /* what the thread's timer slack is now */
+
     /* xrdp stuff */
     int fd;            /* UDS connection to xrdp chansrv */
+    int protocol_version; /* highest we offer, see XRDP_SOURCE_CMD_HELLO */
+    int len32; /* negotiated for this connection */
+    size_t max_read_bytes; /* MAX_READ_USEC of wire audio */
     char *source_socket;
+    struct xrdp_connect conn; /* gets the fd for data_connect() */
     int want_src_data;
+
+    /* streaming mode, chansrv pushes length prefixed data on its own */
+    int streaming;
+    pa_rtpoll_item *rtpoll_item; /* POLLIN watch on fd */
+    unsigned char recv_hdr[4]; /* 2 bytes, 4 with len32 */
+    size_t recv_hdr_len;
+    pa_memchunk recv_chunk; /* payload being received */
+    size_t recv_have;
+
+    struct memblock_pool pool;
+
+    /* transport=memfd, chansrv writes into the ring and the stream
+     * messages carry no payload */
+    struct xrdp_shm shm;
+
+    pa_sample_spec wire_ss; /* what chansrv sends, see wire_conversion */
+    int convert; /* wire_ss differs from the source spec */
+    struct xrdp_convert conv;
+
+    int drift_on; /* drift_compensation=yes and the source format works */
+    struct xrdp_drift drift;
+
+    /* jitter_buffer_msec=, post_capture() fills it and jitter_release()
+     * posts a block every jitter_block_usec */
+    int jitter_on;
+    struct xrdp_jitter jitter;
+    pa_usec_t jitter_block_usec;
+    pa_usec_t jitter_next; /* when the next block is due, 0 while idle */
+
+    struct xrdp_capture capture; /* capture_file=, see xrdp-capture.h */
+
+    struct xrdp_transport_stats stats;
+    struct xrdp_snapshot snapshot; /* written every wakeup, see snapshot_publish() */
+    struct xrdp_transport_stats stats_published; /* main thread, in the proplist */
+    pa_time_event *stats_event; /* main thread, see stats_timer_cb() */
+    pa_usec_t timer_deadline; /* what the rtpoll timer was set to, or 0 */
+
+    struct xrdp_trace trace; /* trace_file=, see xrdp-trace.h */
+    struct xrdp_sched sched; /* applied by the IO thread */
 };
 
 static const char* const valid_modargs[] = {
@@ -110,38 +246,27 @@ static const char* const valid_modargs[] = {
     "latency_time",
     "xrdp_socket_path",
     "xrdp_pulse_source_socket",
+    "streaming",
+    "transport",
+    "wire_conversion",
+    "trace_file",
+    "max_idle_msec",
+    "timer_slack_usec",
+    "sched",
+    "sched_priority",
+    "cpu_affinity",
+    "protocol_version",
+    "drift_compensation",
+    "capture_file",
+    "capture_payload",
+    "capture_max_mb",
+    "jitter_buffer_msec",
+    "conceal_msec",
     NULL
 };
 
-static pa_device_port *xrdp_create_port(struct userdata *u) {
-    pa_device_port_new_data data;
-    pa_device_port *port;
-
-    pa_device_port_new_data_init(&data);
-
-    pa_device_port_new_data_set_name(&data, "xrdp-input");
-    pa_device_port_new_data_set_description(&data, "xrdp input");
-    pa_device_port_new_data_set_direction(&data, PA_DIRECTION_INPUT);
-    pa_device_port_new_data_set_available(&data, PA_AVAILABLE_YES);
-#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(14, 0, 0)
-    pa_device_port_new_data_set_type(&data, PA_DEVICE_PORT_TYPE_NETWORK);
-#endif
-
-    port = pa_device_port_new(u->core, &data, 0);
-
-    pa_device_port_new_data_done(&data);
-
-    if (port == NULL)
-    {
-        return NULL;
-    }
-
-    pa_device_port_ref(port);
-
-    return port;
-}
-
-static pa_card_profile *xrdp_create_profile() {
+/* channels is what the source is created with */
+static pa_card_profile *xrdp_create_profile(uint8_t channels) {
     pa_card_profile *profile;
 
     profile = pa_card_profile_new("input:xrdp", "xrdp audio input", 0);
@@ -149,59 +274,52 @@ static pa_card_profile *xrdp_create_profile() {
     profile->n_sinks = 0;
     profile->n_sources = 1;
     profile->max_sink_channels = 0;
-    profile->max_source_channels = 2;
+    profile->max_source_channels = channels;
 
     return profile;
 }
 
-static pa_card *xrdp_create_card(pa_module *m, pa_device_port *port, pa_card_profile *profile) {
-    pa_card_new_data data;
-    pa_card *card;
-
-    pa_card_new_data_init(&data);
-    data.driver = __FILE__;
-
-    pa_card_new_data_set_name(&data, "xrdp.source");
-
-    pa_hashmap_put(data.ports, port->name, port);
-    pa_hashmap_put(data.profiles, profile->name, profile);
-
-    card = pa_card_new(m->core, &data);
-
-    pa_card_new_data_done(&data);
-
-    if (card == NULL)
-    {
-        return NULL;
+/* captured audio not posted yet */
+static pa_usec_t jitter_usec(struct userdata *u) {
+    if (!u->jitter_on) {
+        return 0;
     }
-
-    pa_card_choose_initial_profile(card);
-
-    pa_card_put(card);
-
-    return card;
+    return pa_bytes_to_usec(xrdp_jitter_fill(&u->jitter), &u->source->sample_spec);
 }
 
-static int get_display_num_from_display(const char *display_text) ;
-
 static int source_process_msg(pa_msgobject *o, int code, void *data,
                               int64_t offset, pa_memchunk *chunk) {
 
     struct userdata *u = PA_SOURCE(o)->userdata;
 
     switch (code) {
+#ifndef USE_SET_STATE_IN_IO_THREAD_CB
         case PA_SOURCE_MESSAGE_SET_STATE:
 
             if (PA_PTR_TO_UINT(data) == PA_SOURCE_RUNNING)
                 u->timestamp = pa_rtclock_now();
+            else {
+                /* the next stream may come from another device */
+                if (u->drift_on)
+                    xrdp_drift_reset(&u->drift);
+                if (u->jitter_on) {
+                    xrdp_jitter_reset(&u->jitter);
+                    u->jitter_next = 0;
+                }
+            }
+            if (PA_PTR_TO_UINT(data) == PA_SOURCE_SUSPENDED)
+                /* pactl suspend-source dumps the trace */
+                xrdp_trace_dump(&u->trace);
 
             break;
+#endif
 
         case PA_SOURCE_MESSAGE_GET_LATENCY: {
             pa_usec_t now;
 
             now = pa_rtclock_now();
-            *((pa_usec_t*) data) = u->timestamp > now ? u->timestamp - now : 0;
+            *((pa_usec_t*) data) = (u->timestamp > now ? u->timestamp - now : 0) +
+                                   jitter_usec(u);
 
             return 0;
         }
@@ -210,6 +328,41 @@ static int source_process_msg(pa_msgobject *o, int code, void *data,
     return pa_source_process_msg(o, code, data, offset, chunk);
 }
 
+#ifdef USE_SET_STATE_IN_IO_THREAD_CB
+/* Called from the IO thread. */
+static int source_set_state_in_io_thread_cb(pa_source *s,
+                                            pa_source_state_t new_state,
+                                            pa_suspend_cause_t new_suspend_cause)
+{
+    struct userdata *u;
+
+    UNUSED_VAR(new_suspend_cause);
+
+    pa_assert(s);
+    pa_assert_se(u = s->userdata);
+
+    if (new_state == PA_SOURCE_RUNNING && s->thread_info.state != PA_SOURCE_RUNNING) {
+        u->timestamp = pa_rtclock_now();
+    }
+    if (!PA_SOURCE_IS_OPENED(new_state)) {
+        /* the next stream may come from another device */
+        if (u->drift_on) {
+            xrdp_drift_reset(&u->drift);
+        }
+        if (u->jitter_on) {
+            xrdp_jitter_reset(&u->jitter);
+            u->jitter_next = 0;
+        }
+    }
+    if (new_state == PA_SOURCE_SUSPENDED && s->thread_info.state != PA_SOURCE_SUSPENDED) {
+        /* pactl suspend-source dumps the trace */
+        xrdp_trace_dump(&u->trace);
+    }
+
+    return 0;
+}
+#endif /* USE_SET_STATE_IN_IO_THREAD_CB */
+
 static void source_update_requested_latency_cb(pa_source *s) {
     struct userdata *u;
 
@@ -220,119 +373,309 @@ static void source_update_requested_latency_cb(pa_source *s) {
     u->block_usec = pa_source_get_requested_latency_within_thread(s);
 }
 
-static int lsend(int fd, char *data, int bytes) {
-    int sent = 0;
-    int error;
-    while (sent < bytes) {
-        error = send(fd, data + sent, bytes - sent, 0);
-        if (error < 1) {
-            return error;
-        }
-        sent += error;
-    }
-    return sent;
+static void memblock_pool_init(struct memblock_pool *p, size_t block_size) {
+    memset(p, 0, sizeof(*p));
+    p->block_size = block_size;
 }
 
-static int lrecv(int fd, char *data, int bytes) {
-    int recved = 0;
-    int error;
-    while (recved < bytes) {
-        error = recv(fd, data + recved, bytes - recved, 0);
-        if (error < 1) {
-            return error;
+static void memblock_pool_done(struct memblock_pool *p) {
+    int i;
+
+    for (i = 0; i < MEMBLOCK_POOL_SIZE; i++) {
+        if (p->blocks[i]) {
+            pa_memblock_unref(p->blocks[i]);
+            p->blocks[i] = NULL;
         }
-        recved += error;
     }
-    return recved;
 }
 
-static int data_get(struct userdata *u, pa_memchunk *chunk) {
-
-    int fd;
-    int bytes;
-    int read_bytes;
-    struct sockaddr_un s;
-    char *data;
-    char buf[11];
-    unsigned char ubuf[10];
-
-    if (u->fd == -1) {
-        /* connect to xrdp unix domain socket */
-        fd = socket(PF_LOCAL, SOCK_STREAM, 0);
-        memset(&s, 0, sizeof(s));
-        s.sun_family = AF_UNIX;
-            pa_strlcpy(s.sun_path, u->source_socket, sizeof(s.sun_path));
-        pa_log_debug("Trying to connect to %s", s.sun_path);
-
-        if (connect(fd, (struct sockaddr *) &s, sizeof(struct sockaddr_un)) != 0) {
-            pa_log_debug("Connect failed");
-            close(fd);
-            return -1;
+/* get a memblock of at least 'bytes', the caller owns one reference */
+static pa_memblock *memblock_pool_get(struct memblock_pool *p,
+                                      pa_mempool *mempool, size_t bytes) {
+    int i;
+
+    if (bytes <= p->block_size) {
+        for (i = 0; i < MEMBLOCK_POOL_SIZE; i++) {
+            if (p->blocks[i] == NULL) {
+                p->blocks[i] = pa_memblock_new(mempool, p->block_size);
+                p->misses++;
+                return pa_memblock_ref(p->blocks[i]);
+            }
+            /* only the pool holds it, so nobody downstream reads it anymore */
+            if (pa_memblock_ref_is_one(p->blocks[i])) {
+                p->hits++;
+                return pa_memblock_ref(p->blocks[i]);
+            }
         }
-
-        pa_log("Connected ok, fd=%d", fd);
-        pa_log_debug("###### connected to xrdp audio_in socket");
-        u->fd = fd;
     }
 
-    if (!u->want_src_data) {
-        char buf[12];
-
-        buf[0]  = 0;
-        buf[1]  = 0;
-        buf[2]  = 0;
-        buf[3]  = 0;
-        buf[4]  = 11;
-        buf[5]  = 0;
-        buf[6]  = 0;
-        buf[7]  = 0;
-        buf[8]  = 1;
-        buf[9]  = 0;
-        buf[10] = 0;
-
-        if (lsend(u->fd, buf, 11) != 11) {
-            close(u->fd);
-            u->fd = -1;
-            return -1;
-        }
-        u->want_src_data = 1;
-        pa_log_debug("###### started recording");
-    }
+    p->misses++;
+    return pa_memblock_new(mempool, bytes);
+}
+
+/* build a command for chansrv: 4 bytes zero, 4 bytes message size, then
+ * the 1 byte command and its 2 byte parameter, 4 bytes with len32, all
+ * little endian. Returns the message size */
+static int build_cmd(char *buf, int cmd, uint32_t param, int len32) {
+    int bytes = len32 ? XRDP_SOURCE_CMD32_BYTES : XRDP_SOURCE_CMD_BYTES;
 
-    /* ask for more data */
     buf[0]  = 0;
     buf[1]  = 0;
     buf[2]  = 0;
     buf[3]  = 0;
-    buf[4]  = 11;
+    buf[4]  = (char) bytes;
     buf[5]  = 0;
     buf[6]  = 0;
     buf[7]  = 0;
-    buf[8]  = 3;
-    buf[9]  = (unsigned char) chunk->length;
-    buf[10] = (unsigned char) ((chunk->length >> 8) & 0xff);
+    buf[8]  = (char) cmd;
+    buf[9]  = (unsigned char) param;
+    buf[10] = (unsigned char) ((param >> 8) & 0xff);
+    if (len32) {
+        buf[11] = (unsigned char) ((param >> 16) & 0xff);
+        buf[12] = (unsigned char) ((param >> 24) & 0xff);
+    }
+    return bytes;
+}
+
+static int send_cmd(struct userdata *u, int cmd, uint32_t param) {
+    char buf[XRDP_SOURCE_CMD32_BYTES];
+    int bytes;
+
+    bytes = build_cmd(buf, cmd, param, u->len32);
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_CMD, cmd, param, NULL, 0);
+    return xrdp_lsend(u->fd, buf, bytes) == bytes ? 0 : -1;
+}
+
+/* hand a new shm ring to chansrv, it picks the size up from the header */
+static int shm_setup(struct userdata *u) {
+    char buf[XRDP_SOURCE_CMD32_BYTES];
+    int bytes;
+
+    if (xrdp_shm_renew(&u->shm) != 0) {
+        return -1;
+    }
+    bytes = build_cmd(buf, XRDP_SOURCE_CMD_SHM_SETUP, 0, u->len32);
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_CMD,
+                     XRDP_SOURCE_CMD_SHM_SETUP, 0, NULL, 0);
+    return xrdp_shm_send_fd(u->fd, u->shm.fd, buf, bytes);
+}
+
+/* a 2 byte length, 4 bytes with len32 */
+static uint32_t get_len(struct userdata *u, const unsigned char *p) {
+    uint32_t bytes = p[0] | (p[1] << 8);
+
+    if (u->len32) {
+        bytes |= ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+    return bytes;
+}
+
+/* offer protocol 2 to a fresh connection. An older chansrv never
+ * answers, then the connection is dropped so a late answer can't be
+ * read as audio, and the next one uses protocol 1. Returns -1 if the
+ * connection failed */
+static int hello(struct userdata *u) {
+    unsigned char buf[XRDP_SOURCE_CMD32_BYTES];
+    struct pollfd pfd;
+    uint32_t param;
+    int version;
+    int rv;
+
+    u->len32 = 0;
+    if (u->protocol_version < 2) {
+        return 0;
+    }
 
-    if (lsend(u->fd, buf, 11) != 11) {
+    param = XRDP_SOURCE_PROTOCOL_VERSION | (XRDP_SOURCE_CAP_LEN32 << 16);
+    build_cmd((char *) buf, XRDP_SOURCE_CMD_HELLO, param, 1);
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_CMD,
+                     XRDP_SOURCE_CMD_HELLO, param, NULL, 0);
+    if (xrdp_lsend(u->fd, (char *) buf, sizeof(buf)) != sizeof(buf)) {
+        return -1;
+    }
+
+    pfd.fd = u->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while ((rv = poll(&pfd, 1, HELLO_TIMEOUT_MSEC)) < 0 && errno == EINTR) {
+    }
+    if (rv == 0) {
+        pa_log("chansrv did not answer HELLO, reconnecting with source protocol 1");
+        u->protocol_version = 1;
+        return -1;
+    }
+    if (rv < 0 || xrdp_lrecv(u->fd, (char *) buf, sizeof(buf)) != sizeof(buf)) {
+        return -1;
+    }
+    if (buf[8] != XRDP_SOURCE_CMD_HELLO || buf[4] != sizeof(buf)) {
+        pa_log("unexpected answer to HELLO from chansrv, command %d", buf[8]);
+        return -1;
+    }
+    param = buf[9] | (buf[10] << 8) | ((uint32_t) buf[11] << 16) |
+            ((uint32_t) buf[12] << 24);
+    /* the answer is a command too */
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_DATA,
+                     XRDP_SOURCE_CMD_HELLO, param, NULL, 0);
+    version = MIN((int) (param & 0xffff), XRDP_SOURCE_PROTOCOL_VERSION);
+    u->len32 = version >= 2 && ((param >> 16) & XRDP_SOURCE_CAP_LEN32);
+    pa_log_info("source protocol %d with chansrv%s", version,
+                u->len32 ? ", 32 bit lengths" : "");
+    return 0;
+}
+
+static void recv_reset(struct userdata *u) {
+    if (u->recv_chunk.memblock) {
+        pa_memblock_unref(u->recv_chunk.memblock);
+    }
+    memset(&u->recv_chunk, 0, sizeof(u->recv_chunk));
+    u->recv_hdr_len = 0;
+    u->recv_have = 0;
+}
+
+static void data_close(struct userdata *u) {
+    if (u->rtpoll_item) {
+        pa_rtpoll_item_free(u->rtpoll_item);
+        u->rtpoll_item = NULL;
+    }
+    if (u->fd >= 0) {
         close(u->fd);
         u->fd = -1;
-        u->want_src_data = 0;
+    }
+    u->want_src_data = 0;
+    recv_reset(u);
+}
+
+static int data_connect(struct userdata *u) {
+    int fd;
+    struct pollfd *pollfd;
+
+    if (u->fd != -1) {
+        return 0;
+    }
+
+    /* the connect runs in the background, see xrdp-connect.c */
+    if ((fd = xrdp_connect_get(&u->conn, pa_rtclock_now())) < 0) {
+        return -1;
+    }
+
+    pa_log_debug("###### connected to xrdp audio_in socket");
+    u->fd = fd;
+    u->stats.connects++;
+
+    if (hello(u) != 0) {
+        data_close(u);
+        xrdp_connect_failed(&u->conn, pa_rtclock_now());
+        return -1;
+    }
+
+    if (u->streaming) {
+        u->rtpoll_item = pa_rtpoll_item_new(u->rtpoll, PA_RTPOLL_NEVER, 1);
+        pollfd = pa_rtpoll_item_get_pollfd(u->rtpoll_item, NULL);
+        pollfd->fd = fd;
+        pollfd->events = POLLIN;
+        pollfd->revents = 0;
+    }
+
+    return 0;
+}
+
+static int data_start(struct userdata *u) {
+    if (u->want_src_data) {
+        return 0;
+    }
+
+    if (send_cmd(u, XRDP_SOURCE_CMD_START, 0) != 0) {
+        data_close(u);
+        xrdp_connect_failed(&u->conn, pa_rtclock_now());
+        return -1;
+    }
+    if (u->shm.hdr && shm_setup(u) != 0) {
+        data_close(u);
+        xrdp_connect_failed(&u->conn, pa_rtclock_now());
+        return -1;
+    }
+    if (u->streaming) {
+        /* chansrv pushes about one latency_time worth per message */
+        size_t bytes = pa_usec_to_bytes(u->latency_time * PA_USEC_PER_MSEC,
+                                        &u->wire_ss);
+
+        if (send_cmd(u, XRDP_SOURCE_CMD_STREAM,
+                     u->len32 ? bytes : MIN(bytes, 0xffff)) != 0) {
+            data_close(u);
+            xrdp_connect_failed(&u->conn, pa_rtclock_now());
+            return -1;
+        }
+    }
+    u->want_src_data = 1;
+    pa_log_debug("###### started recording");
+
+    return 0;
+}
+
+static void data_stop(struct userdata *u) {
+    if (!u->want_src_data) {
+        return;
+    }
+
+    /* we don't want source data anymore */
+    if (send_cmd(u, XRDP_SOURCE_CMD_STOP, 0) != 0) {
+        data_close(u);
+    }
+    u->want_src_data = 0;
+    pa_log_debug("###### stopped recording");
+}
+
+static int data_get(struct userdata *u, pa_memchunk *chunk) {
+
+    int bytes;
+    int read_bytes;
+    int len_bytes;
+    char *data;
+    unsigned char ubuf[10];
+
+    if (data_connect(u) != 0) {
+        return -1;
+    }
+
+    if (data_start(u) != 0) {
+        return -1;
+    }
+
+    /* the whole backlog in one go with 32 bit lengths, otherwise what
+     * fits in 16 bits */
+    chunk->length = MIN(chunk->length,
+                        u->len32 ? u->max_read_bytes
+                                 : 0xffff - 0xffff % pa_frame_size(&u->wire_ss));
+
+    /* ask for more data */
+    if (send_cmd(u, XRDP_SOURCE_CMD_READ, chunk->length) != 0) {
+        data_close(u);
         return -1;
     }
 
     /* read length of data available */
-    if (lrecv(u->fd, (char *) ubuf, 2) != 2) {
-        close(u->fd);
-        u->fd = -1;
-        u->want_src_data = 0;
+    u->stats.recv_calls++;
+    len_bytes = u->len32 ? 4 : 2;
+    if (xrdp_lrecv(u->fd, (char *) ubuf, len_bytes) != len_bytes) {
+        data_close(u);
+        return -1;
+    }
+    bytes = get_len(u, ubuf);
+    if (u->len32 && (size_t) bytes > chunk->length) {
+        pa_log("data_get: chansrv sent %d bytes, asked for %lu", bytes,
+               (unsigned long) chunk->length);
+        data_close(u);
         return -1;
     }
-    bytes = ((ubuf[1] << 8) & 0xff00) | (ubuf[0] & 0xff);
 
     if (bytes == 0) {
+        /* chansrv had nothing for us */
+        xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_DATA, 0, 0, NULL, 0);
+        u->stats.underruns++;
         return 0;
     }
 
-    chunk->memblock = pa_memblock_new(u->core->mempool, bytes);
+    chunk->memblock = memblock_pool_get(&u->pool, u->core->mempool, bytes);
     if (chunk->memblock == NULL) {
         return 0;
     }
@@ -343,20 +686,296 @@ static int data_get(struct userdata *u, pa_memchunk *chunk) {
     }
 
     /* get data */
-    read_bytes = lrecv(u->fd, data, bytes);
+    u->stats.recv_calls++;
+    read_bytes = xrdp_lrecv(u->fd, data, bytes);
     if (read_bytes != bytes) {
-        close(u->fd);
-        u->fd = -1;
         pa_memblock_release(chunk->memblock);
-        u->want_src_data = 0;
+        data_close(u);
         return -1;
     }
+    xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_DATA, 0, bytes, data, bytes);
 
     pa_memblock_release(chunk->memblock);
 
     return read_bytes;
 }
 
+/* hand audio in the source format on, through the jitter buffer if
+ * there is one */
+static void source_post(struct userdata *u, pa_memchunk *chunk) {
+    char *data;
+
+    if (!u->jitter_on) {
+        pa_source_post(u->source, chunk);
+        return;
+    }
+    data = (char *) pa_memblock_acquire(chunk->memblock) + chunk->index;
+    xrdp_jitter_push(&u->jitter, data, chunk->length);
+    pa_memblock_release(chunk->memblock);
+}
+
+/* post a chunk received in the wire format, converting it first if the
+ * source spec differs */
+static void post_capture(struct userdata *u, pa_memchunk *chunk) {
+    pa_memchunk conv;
+    pa_memchunk out;
+    char *src;
+    char *dst;
+
+    u->stats.frames_received++;
+    u->stats.bytes_received += chunk->length;
+    XRDP_TRACE(&u->trace, XRDP_TRACE_CAPTURE, chunk->length);
+
+    if (u->drift_on) {
+        xrdp_drift_update(&u->drift, pa_rtclock_now(),
+                          chunk->length / pa_frame_size(&u->wire_ss));
+        u->stats.drift_ppm = xrdp_drift_ppm(&u->drift);
+    }
+
+    if (!u->convert && !u->drift_on) {
+        source_post(u, chunk);
+        return;
+    }
+
+    if (u->convert) {
+        conv.index = 0;
+        conv.length = xrdp_convert_out_bytes(&u->conv, chunk->length);
+        if (conv.length == 0) {
+            return;
+        }
+        conv.memblock = memblock_pool_get(&u->pool, u->core->mempool, conv.length);
+
+        src = (char *) pa_memblock_acquire(chunk->memblock) + chunk->index;
+        dst = (char *) pa_memblock_acquire(conv.memblock);
+        xrdp_convert_run(&u->conv, dst, src, chunk->length);
+        pa_memblock_release(conv.memblock);
+        pa_memblock_release(chunk->memblock);
+    } else {
+        conv = *chunk;
+        pa_memblock_ref(conv.memblock);
+    }
+
+    if (u->drift_on) {
+        /* resampled to the local clock, in the source format */
+        out.index = 0;
+        out.memblock = memblock_pool_get(&u->pool, u->core->mempool,
+                                         xrdp_drift_out_bytes(&u->drift, conv.length));
+
+        src = (char *) pa_memblock_acquire(conv.memblock) + conv.index;
+        dst = (char *) pa_memblock_acquire(out.memblock);
+        out.length = xrdp_drift_run(&u->drift, dst, src, conv.length);
+        pa_memblock_release(out.memblock);
+        pa_memblock_release(conv.memblock);
+        pa_memblock_unref(conv.memblock);
+        conv = out;
+    }
+
+    if (conv.length > 0) {
+        source_post(u, &conv);
+    }
+    pa_memblock_unref(conv.memblock);
+}
+
+/* transport=memfd: post everything chansrv has put in the ring */
+static void shm_drain(struct userdata *u) {
+    pa_memchunk chunk;
+    size_t bytes;
+    char *data;
+
+    while ((bytes = xrdp_shm_readable(&u->shm)) > 0) {
+        bytes = MIN(bytes, u->pool.block_size);
+        chunk.memblock = memblock_pool_get(&u->pool, u->core->mempool, bytes);
+        chunk.index = 0;
+        data = (char *) pa_memblock_acquire(chunk.memblock);
+        chunk.length = xrdp_shm_read(&u->shm, data, bytes);
+        pa_memblock_release(chunk.memblock);
+        if (u->source->thread_info.state == PA_SOURCE_RUNNING) {
+            post_capture(u, &chunk);
+            u->timestamp = pa_rtclock_now();
+        }
+        pa_memblock_unref(chunk.memblock);
+    }
+}
+
+/* streaming mode: read whatever chansrv has pushed without blocking and
+ * post every complete message. Returns -1 if the connection failed */
+static int data_read_stream(struct userdata *u) {
+    ssize_t got;
+    size_t hdr_bytes;
+    size_t bytes;
+    char *data;
+
+    hdr_bytes = u->len32 ? 4 : 2;
+    for (;;) {
+        if (u->recv_hdr_len < hdr_bytes) {
+            u->stats.recv_calls++;
+            got = recv(u->fd, u->recv_hdr + u->recv_hdr_len,
+                       hdr_bytes - u->recv_hdr_len, MSG_DONTWAIT);
+            if (got <= 0) {
+                break;
+            }
+            u->recv_hdr_len += got;
+            if (u->recv_hdr_len < hdr_bytes) {
+                continue;
+            }
+            bytes = get_len(u, u->recv_hdr);
+            if (bytes > u->max_read_bytes) {
+                pa_log("data_read_stream: %lu byte message from chansrv",
+                       (unsigned long) bytes);
+                return -1;
+            }
+            if (bytes == 0 || u->shm.hdr) {
+                xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_DATA, 0,
+                                 bytes, NULL, 0);
+                /* with shm the message is only a wakeup */
+                if (u->shm.hdr) {
+                    shm_drain(u);
+                }
+                u->recv_hdr_len = 0;
+                continue;
+            }
+            u->recv_chunk.memblock = memblock_pool_get(&u->pool,
+                                                       u->core->mempool, bytes);
+            u->recv_chunk.index = 0;
+            u->recv_chunk.length = bytes;
+            u->recv_have = 0;
+        }
+
+        data = (char *) pa_memblock_acquire(u->recv_chunk.memblock);
+        u->stats.recv_calls++;
+        got = recv(u->fd, data + u->recv_have,
+                   u->recv_chunk.length - u->recv_have, MSG_DONTWAIT);
+        pa_memblock_release(u->recv_chunk.memblock);
+        if (got <= 0) {
+            break;
+        }
+        u->recv_have += got;
+
+        if (u->recv_have == u->recv_chunk.length) {
+            data = (char *) pa_memblock_acquire(u->recv_chunk.memblock);
+            xrdp_capture_add(&u->capture, XRDP_CAPTURE_SOURCE_DATA, 0,
+                             u->recv_chunk.length, data, u->recv_chunk.length);
+            pa_memblock_release(u->recv_chunk.memblock);
+            /* chansrv may still be flushing after we asked it to stop */
+            if (u->source->thread_info.state == PA_SOURCE_RUNNING) {
+                pa_usec_t start = pa_rtclock_now();
+
+                post_capture(u, &u->recv_chunk);
+                u->timestamp = pa_rtclock_now();
+                xrdp_stats_add_process(&u->stats, u->timestamp - start);
+            }
+            recv_reset(u);
+        }
+    }
+
+    if (got == 0) {
+        pa_log("data_read_stream: chansrv closed the connection");
+        return -1;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+    }
+    pa_log("data_read_stream: recv failed: %s", pa_cstrerror(errno));
+    return -1;
+}
+
+/* jitter_buffer_msec: post what is due on the local clock, one block
+ * at a time whether the client kept up or not */
+static void jitter_release(struct userdata *u, pa_usec_t now) {
+    pa_memchunk chunk;
+    char *data;
+
+    if (u->jitter_next == 0 ||
+        now > u->jitter_next + 4 * u->jitter_block_usec) {
+        /* started, or the thread was held up, don't post a backlog of
+         * concealment in one go */
+        u->jitter_next = now;
+    }
+    while (u->jitter_next <= now) {
+        chunk.memblock = memblock_pool_get(&u->pool, u->core->mempool,
+                                           u->jitter.block);
+        chunk.index = 0;
+        data = (char *) pa_memblock_acquire(chunk.memblock);
+        chunk.length = xrdp_jitter_pull(&u->jitter, data);
+        pa_memblock_release(chunk.memblock);
+        if (chunk.length == 0) {
+            /* filling up, the next arrival starts the clock */
+            pa_memblock_unref(chunk.memblock);
+            u->jitter_next = 0;
+            break;
+        }
+        pa_source_post(u->source, &chunk);
+        pa_memblock_unref(chunk.memblock);
+        u->jitter_next += u->jitter_block_usec;
+    }
+
+    u->stats.jitter_buffer_usec = jitter_usec(u);
+    u->stats.concealments = u->jitter.concealments;
+    u->stats.concealed_frames = u->jitter.concealed_frames;
+    u->stats.jitter_buffer_overflows = u->jitter.overflows;
+}
+
+/* let the main thread see the current state, no syscalls here */
+static void snapshot_publish(struct userdata *u, pa_usec_t now) {
+    struct xrdp_snapshot_data d;
+
+    d.time = now;
+    d.timestamp = u->timestamp;
+    d.downstream_usec = jitter_usec(u);
+    d.queued_bytes = 0;
+    d.chansrv_queued_bytes = 0;
+    d.stats = u->stats;
+    xrdp_snapshot_write(&u->snapshot, &d);
+}
+
+/* main thread: changed stats from the snapshot go into the proplist,
+ * the IO thread is not involved */
+static void stats_timer_cb(pa_mainloop_api *a, pa_time_event *e,
+                           const struct timeval *tv, void *userdata) {
+    struct userdata *u = userdata;
+    struct xrdp_snapshot_data d;
+    pa_proplist *pl;
+    pa_usec_t now;
+
+    UNUSED_VAR(a);
+    UNUSED_VAR(tv);
+
+    now = pa_rtclock_now();
+    pa_core_rttime_restart(u->core, e, now + STATS_PUBLISH_USEC);
+    xrdp_snapshot_read(&u->snapshot, &d);
+    if (!PA_SOURCE_IS_LINKED(u->source->state) ||
+        memcmp(&d.stats, &u->stats_published, sizeof(d.stats)) == 0) {
+        return;
+    }
+    u->stats_published = d.stats;
+
+    pl = pa_proplist_new();
+    xrdp_stats_to_proplist(&d.stats, pl);
+    pa_proplist_setf(pl, "xrdp.stats.latency_usec", "%llu",
+                     (unsigned long long) xrdp_snapshot_latency(&d, now));
+    pa_source_update_proplist(u->source, PA_UPDATE_REPLACE, pl);
+    pa_proplist_free(pl);
+}
+
+/* poll mode: double the poll interval on every read that found nothing
+ * and go straight back to latency_time once data flows. The timer slack
+ * grows with the interval so idle sources coalesce with other timers */
+static void poll_adapt(struct userdata *u, int got_data) {
+    pa_usec_t slack;
+
+    if (got_data) {
+        u->poll_usec = u->latency_time * PA_USEC_PER_MSEC;
+    } else {
+        u->poll_usec = MIN(u->poll_usec * 2,
+                           MAX(u->max_idle_usec, u->latency_time * PA_USEC_PER_MSEC));
+    }
+    slack = MAX(u->timer_slack_usec, u->poll_usec / 4);
+    if (slack != u->slack_set) {
+        xrdp_set_timer_slack(slack);
+        u->slack_set = slack;
+    }
+}
+
 static void thread_func(void *userdata) {
     struct userdata *u = userdata;
     int bytes;
@@ -364,56 +983,74 @@ static void thread_func(void *userdata) {
     pa_assert(u);
     pa_thread_mq_install(&u->thread_mq);
     u->timestamp = pa_rtclock_now();
+    poll_adapt(u, 1);
+    xrdp_sched_apply(&u->sched, &u->stats);
 
     for (;;) {
         int ret;
 
-        if (u->source->thread_info.state == PA_SOURCE_RUNNING) {
+        u->timer_deadline = 0;
+        if (u->source->thread_info.state == PA_SOURCE_RUNNING && u->streaming) {
+            /* data arrives on the socket, the timer only retries connect
+             * and releases the jitter buffer */
+            pa_usec_t next;
+
+            if (u->jitter_on) {
+                jitter_release(u, pa_rtclock_now());
+            }
+            if (data_connect(u) == 0 && data_start(u) == 0) {
+                next = 0;
+            } else {
+                next = xrdp_connect_next_attempt(&u->conn);
+            }
+            if (u->jitter_next != 0 && (next == 0 || u->jitter_next < next)) {
+                next = u->jitter_next;
+                u->timer_deadline = next;
+            }
+            if (next != 0) {
+                pa_rtpoll_set_timer_absolute(u->rtpoll, next);
+            } else {
+                pa_rtpoll_set_timer_disabled(u->rtpoll);
+            }
+        } else if (u->source->thread_info.state == PA_SOURCE_RUNNING) {
             pa_usec_t now;
             pa_memchunk chunk;
 
             now = pa_rtclock_now();
 
+            bytes = 0;
             memset(&chunk, 0, sizeof(chunk));
-            if ((chunk.length = pa_usec_to_bytes(now - u->timestamp, &u->source->sample_spec)) > 0) {
+            if ((chunk.length = pa_usec_to_bytes(now - u->timestamp, &u->wire_ss)) > 0) {
+                /* data_get() clamps it, timestamp stays put while reads
+                 * come back empty */
                 chunk.length *= 4;
                 bytes = data_get(u, &chunk);
                 if (bytes > 0) {
                     chunk.length = bytes;
-                    pa_source_post(u->source, &chunk);
+                    post_capture(u, &chunk);
                     u->timestamp = now;
+                    xrdp_stats_add_process(&u->stats, pa_rtclock_now() - now);
                 }
                 if (chunk.memblock) {
                     pa_memblock_unref(chunk.memblock);
                 }
             }
-            pa_rtpoll_set_timer_absolute(u->rtpoll, now + u->latency_time * PA_USEC_PER_MSEC);
-        } else {
-            if (u->want_src_data)
-            {
-                /* we don't want source data anymore */
-                char buf[12];
-
-                buf[0]  = 0;
-                buf[1]  = 0;
-                buf[2]  = 0;
-                buf[3]  = 0;
-                buf[4]  = 11;
-                buf[5]  = 0;
-                buf[6]  = 0;
-                buf[7]  = 0;
-                buf[8]  = 2;
-                buf[9]  = 0;
-                buf[10] = 0;
-
-                if (lsend(u->fd, buf, 11) != 11) {
-                    close(u->fd);
-                    u->fd = -1;
-                }
-                u->want_src_data = 0;
-                pa_log_debug("###### stopped recording");
+            if (u->jitter_on) {
+                jitter_release(u, now);
+            }
+            poll_adapt(u, bytes > 0);
+            u->timer_deadline = now + u->poll_usec;
+            if (u->jitter_next != 0) {
+                u->timer_deadline = MIN(u->timer_deadline, u->jitter_next);
             }
+            pa_rtpoll_set_timer_absolute(u->rtpoll, u->timer_deadline);
+        } else {
+            data_stop(u);
             pa_rtpoll_set_timer_disabled(u->rtpoll);
+            if (u->poll_usec != u->latency_time * PA_USEC_PER_MSEC) {
+                /* start the next recording at full speed */
+                poll_adapt(u, 1);
+            }
         }
 
         /* Hmm, nothing to do. Let's sleep */
@@ -427,6 +1064,32 @@ static void thread_func(void *userdata) {
 
         if (ret == 0)
             goto finish;
+
+        if (u->timer_deadline != 0) {
+            pa_usec_t woke = pa_rtclock_now();
+
+            if (woke >= u->timer_deadline) {
+                xrdp_stats_add_jitter(&u->stats, woke - u->timer_deadline);
+                XRDP_TRACE(&u->trace, XRDP_TRACE_WAKEUP, woke - u->timer_deadline);
+            }
+        }
+        snapshot_publish(u, pa_rtclock_now());
+
+        xrdp_connect_process(&u->conn);
+
+        if (u->rtpoll_item) {
+            struct pollfd *pollfd;
+
+            pollfd = pa_rtpoll_item_get_pollfd(u->rtpoll_item, NULL);
+            if (pollfd->revents & POLLIN) {
+                if (data_read_stream(u) != 0) {
+                    data_close(u);
+                }
+            } else if (pollfd->revents & ~POLLIN) {
+                pa_log("chansrv connection error or hangup");
+                data_close(u);
+            }
+        }
     }
 
 fail:
@@ -439,36 +1102,6 @@ finish:
     pa_log_debug("###### thread shutting down");
 }
 
-static void set_source_socket(pa_modargs *ma, struct userdata *u) {
-    const char *socket_dir;
-    const char *socket_name;
-    char default_socket_name[64];
-    size_t nbytes;
-
-
-    socket_dir = pa_modargs_get_value(ma, "xrdp_socket_path",
-                                      getenv("XRDP_SOCKET_PATH"));
-    if (socket_dir == NULL || socket_dir[0] == '\0') {
-        socket_dir = "/tmp/.xrdp";
-    }
-
-    socket_name = pa_modargs_get_value(ma, "xrdp_pulse_source_socket",
-                                       getenv("XRDP_PULSE_SOURCE_SOCKET"));
-    if (socket_name == NULL || socket_name[0] == '\0')
-    {
-        int display_num = get_display_num_from_display(getenv("DISPLAY"));
-
-        pa_log_debug("Could not obtain source_socket from environment.");
-        snprintf(default_socket_name, sizeof(default_socket_name),
-                 "xrdp_chansrv_audio_out_socket_%d", display_num);
-        socket_name = default_socket_name;
-    }
-
-    nbytes = strlen(socket_dir) + 1 + strlen(socket_name) + 1;
-    u->source_socket = pa_xmalloc(nbytes);
-    snprintf(u->source_socket, nbytes, "%s/%s", socket_dir, socket_name);
-}
-
 int pa__init(pa_module *m) {
     struct userdata *u = NULL;
     pa_device_port *port;
@@ -478,6 +1111,19 @@ int pa__init(pa_module *m) {
     pa_modargs *ma = NULL;
     pa_source_new_data data;
     uint32_t latency_time = DEFAULT_LATENCY_TIME;
+    uint32_t max_idle_msec = DEFAULT_MAX_IDLE_MSEC;
+    uint32_t timer_slack_usec = DEFAULT_TIMER_SLACK_USEC;
+    uint32_t protocol_version = DEFAULT_PROTOCOL_VERSION;
+    pa_bool_t drift_compensation = FALSE;
+    uint32_t jitter_buffer_msec = DEFAULT_JITTER_BUFFER_MSEC;
+    uint32_t conceal_msec = DEFAULT_CONCEAL_MSEC;
+    const char *capture_file;
+    pa_bool_t capture_payload = FALSE;
+    uint32_t capture_max_mb = DEFAULT_CAPTURE_MAX_MB;
+    pa_bool_t streaming = FALSE;
+    const char *transport;
+    pa_bool_t wire_conversion = FALSE;
+    pa_channel_map wire_map;
 
     pa_assert(m);
 
@@ -518,6 +1164,7 @@ int pa__init(pa_module *m) {
     m->userdata = u = pa_xnew0(struct userdata, 1);
     u->core = m->core;
     u->module = m;
+    u->shm.fd = -1;
     u->rtpoll = pa_rtpoll_new();
     pa_thread_mq_init(&u->thread_mq, m->core->mainloop, u->rtpoll);
 
@@ -532,17 +1179,18 @@ int pa__init(pa_module *m) {
     pa_proplist_sets(data.proplist, PA_PROP_DEVICE_FORM_FACTOR, "microphone");
     pa_proplist_sets(data.proplist, PA_PROP_DEVICE_PRODUCT_NAME, "xrdp");
 
-    port = xrdp_create_port(u);
+    port = xrdp_create_port(u->core, "xrdp-input", "xrdp input",
+                            PA_DIRECTION_INPUT);
     if (port == NULL) {
         pa_log("Failed to create port object");
         goto fail;
     }
 
-    profile = xrdp_create_profile();
+    profile = xrdp_create_profile(ss.channels);
 
     pa_hashmap_put(port->profiles, profile->name, profile);
 
-    u->card = xrdp_create_card(m, port, profile);
+    u->card = xrdp_create_card(m, __FILE__, "xrdp.source", port, profile);
     if (u->card == NULL) {
         pa_log("Failed to create card object");
         goto fail;
@@ -567,8 +1215,64 @@ int pa__init(pa_module *m) {
     }
     u->latency_time = latency_time;
 
+    if (pa_modargs_get_value_u32(ma, "max_idle_msec", &max_idle_msec) < 0 ||
+        pa_modargs_get_value_u32(ma, "timer_slack_usec", &timer_slack_usec) < 0) {
+        pa_log("Failed to parse max_idle_msec or timer_slack_usec value.");
+        goto fail;
+    }
+    u->max_idle_usec = max_idle_msec * PA_USEC_PER_MSEC;
+    u->timer_slack_usec = timer_slack_usec;
+
+    if (pa_modargs_get_value_boolean(ma, "streaming", &streaming) < 0) {
+        pa_log("Failed to parse streaming value.");
+        goto fail;
+    }
+    u->streaming = streaming;
+
+    if (pa_modargs_get_value_boolean(ma, "wire_conversion", &wire_conversion) < 0) {
+        pa_log("Failed to parse wire_conversion value.");
+        goto fail;
+    }
+    u->wire_ss = u->source->sample_spec;
+    if (wire_conversion) {
+        /* chansrv delivers S16 stereo, convert and remix it here instead
+         * of in the generic remapper */
+        u->wire_ss.format = PA_SAMPLE_S16NE;
+        u->wire_ss.channels = 2;
+        pa_channel_map_init_stereo(&wire_map);
+        if (!pa_sample_spec_equal(&u->wire_ss, &u->source->sample_spec) ||
+            !pa_channel_map_equal(&wire_map, &u->source->channel_map)) {
+            if (xrdp_convert_init(&u->conv, m->core, &u->wire_ss, &wire_map,
+                                  &u->source->sample_spec,
+                                  &u->source->channel_map) != 0) {
+                pa_log("Failed to set up wire format conversion");
+                goto fail;
+            }
+            u->convert = 1;
+        }
+    }
+
+    transport = pa_modargs_get_value(ma, "transport", "socket");
+    if (strcmp(transport, "memfd") == 0) {
+        if (!u->streaming) {
+            pa_log("transport=memfd needs streaming=yes");
+            goto fail;
+        }
+        if (xrdp_shm_create(&u->shm, "xrdp-source",
+                            pa_usec_to_bytes(SHM_RING_USEC, &u->wire_ss)) != 0) {
+            pa_log("Failed to set up memfd transport");
+            goto fail;
+        }
+    } else if (strcmp(transport, "socket") != 0) {
+        pa_log("Invalid transport '%s', expected socket or memfd", transport);
+        goto fail;
+    }
+
     u->source->parent.process_msg = source_process_msg;
     u->source->update_requested_latency = source_update_requested_latency_cb;
+#ifdef USE_SET_STATE_IN_IO_THREAD_CB
+    u->source->set_state_in_io_thread = source_set_state_in_io_thread_cb;
+#endif
     u->source->userdata = u;
 
     pa_source_set_asyncmsgq(u->source, u->thread_mq.inq);
@@ -580,7 +1284,82 @@ int pa__init(pa_module *m) {
     u->source->thread_info.max_rewind =
         pa_usec_to_bytes(u->block_usec, &u->source->sample_spec);
 
-    set_source_socket(ma, u);
+    /* never less than a 16 bit length can say */
+    u->max_read_bytes = MAX(pa_usec_to_bytes(MAX_READ_USEC, &u->wire_ss), 0xffff);
+    if (pa_modargs_get_value_u32(ma, "protocol_version", &protocol_version) < 0 ||
+        protocol_version < 1 || protocol_version > XRDP_SOURCE_PROTOCOL_VERSION) {
+        pa_log("Failed to parse protocol_version value, expected 1 or 2.");
+        goto fail;
+    }
+    u->protocol_version = (int) protocol_version;
+
+    capture_file = pa_modargs_get_value(ma, "capture_file", NULL);
+    if (pa_modargs_get_value_boolean(ma, "capture_payload", &capture_payload) < 0 ||
+        pa_modargs_get_value_u32(ma, "capture_max_mb", &capture_max_mb) < 0) {
+        pa_log("Failed to parse capture values.");
+        goto fail;
+    }
+    if (capture_file &&
+        xrdp_capture_open(&u->capture, capture_file,
+                          (size_t) capture_max_mb * 1024 * 1024,
+                          capture_payload, &u->wire_ss) != 0) {
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_boolean(ma, "drift_compensation",
+                                     &drift_compensation) < 0) {
+        pa_log("Failed to parse drift_compensation value.");
+        goto fail;
+    }
+    if (drift_compensation) {
+        if (xrdp_drift_init(&u->drift, &u->source->sample_spec) == 0) {
+            u->drift_on = 1;
+        } else {
+            pa_log_info("no drift compensation for %s, needs s16ne or float32ne",
+                        pa_sample_format_to_string(u->source->sample_spec.format));
+        }
+    }
+
+    if (pa_modargs_get_value_u32(ma, "jitter_buffer_msec", &jitter_buffer_msec) < 0 ||
+        pa_modargs_get_value_u32(ma, "conceal_msec", &conceal_msec) < 0) {
+        pa_log("Failed to parse jitter buffer values.");
+        goto fail;
+    }
+    if (jitter_buffer_msec > 0) {
+        /* released in latency_time blocks, the target is at least one */
+        if (xrdp_jitter_init(&u->jitter, &u->source->sample_spec,
+                             pa_usec_to_bytes(u->latency_time * PA_USEC_PER_MSEC,
+                                              &u->source->sample_spec),
+                             pa_usec_to_bytes(jitter_buffer_msec * PA_USEC_PER_MSEC,
+                                              &u->source->sample_spec),
+                             pa_usec_to_bytes(conceal_msec * PA_USEC_PER_MSEC,
+                                              &u->source->sample_spec)) == 0) {
+            u->jitter_on = 1;
+            u->jitter_block_usec = pa_bytes_to_usec(u->jitter.block,
+                                                    &u->source->sample_spec);
+        } else {
+            pa_log_info("no jitter buffer for %s, needs s16ne or float32ne",
+                        pa_sample_format_to_string(u->source->sample_spec.format));
+        }
+    }
+
+    /* poll mode asks for up to four periods at once, the blocks hold
+     * them in whichever of the wire and source formats is bigger */
+    memblock_pool_init(&u->pool,
+                       MIN(MAX(pa_usec_to_bytes(4 * u->latency_time * PA_USEC_PER_MSEC,
+                                                &u->source->sample_spec),
+                               pa_usec_to_bytes(4 * u->latency_time * PA_USEC_PER_MSEC,
+                                                &u->wire_ss)),
+                           pa_mempool_block_size_max(m->core->mempool)));
+
+    u->source_socket = xrdp_socket_path(ma, "xrdp_pulse_source_socket",
+                                        "XRDP_PULSE_SOURCE_SOCKET",
+                                        "xrdp_chansrv_audio_out_socket_%d");
+    xrdp_connect_init(&u->conn, u->rtpoll, u->source_socket);
+    xrdp_trace_init(&u->trace, pa_modargs_get_value(ma, "trace_file", NULL));
+    if (xrdp_sched_parse(&u->sched, ma, m->core) != 0) {
+        goto fail;
+    }
 
     u->fd = -1;
 
@@ -599,6 +1378,9 @@ int pa__init(pa_module *m) {
 
     pa_source_put(u->source);
 
+    u->stats_event = pa_core_rttime_new(m->core, pa_rtclock_now() + STATS_PUBLISH_USEC,
+                                        stats_timer_cb, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -620,6 +1402,9 @@ void pa__done(pa_module*m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->stats_event)
+        u->core->mainloop->time_free(u->stats_event);
+
     if (u->source)
         pa_source_unlink(u->source);
 
@@ -631,6 +1416,11 @@ void pa__done(pa_module*m) {
 
     pa_thread_mq_done(&u->thread_mq);
 
+    if (u->rtpoll_item)
+        pa_rtpoll_item_free(u->rtpoll_item);
+
+    xrdp_connect_done(&u->conn);
+
     if (u->rtpoll)
         pa_rtpoll_free(u->rtpoll);
 
@@ -640,6 +1430,22 @@ void pa__done(pa_module*m) {
         u->fd = -1;
     }
 
+    if (u->recv_chunk.memblock)
+        pa_memblock_unref(u->recv_chunk.memblock);
+
+    pa_log_debug("memblock pool hits %llu misses %llu",
+                 (unsigned long long) u->pool.hits,
+                 (unsigned long long) u->pool.misses);
+    memblock_pool_done(&u->pool);
+    xrdp_shm_destroy(&u->shm);
+    xrdp_convert_done(&u->conv);
+    xrdp_jitter_done(&u->jitter);
+
+    /* the IO thread is gone */
+    xrdp_trace_dump(&u->trace);
+    xrdp_trace_done(&u->trace);
+    xrdp_capture_close(&u->capture);
+
     if (u->card)
     {
         pa_card_free(u->card);
@@ -648,52 +1454,3 @@ void pa__done(pa_module*m) {
     pa_xfree(u->source_socket);
     pa_xfree(u);
 }
-
-static int get_display_num_from_display(const char *display_text) {
-    int index;
-    int mode;
-    int host_index;
-    int disp_index;
-    int scre_index;
-    int display_num;
-    char host[256];
-    char disp[256];
-    char scre[256];
-
-    if (display_text == NULL) {
-        return 0;
-    }
-    memset(host, 0, 256);
-    memset(disp, 0, 256);
-    memset(scre, 0, 256);
-
-    index = 0;
-    host_index = 0;
-    disp_index = 0;
-    scre_index = 0;
-    mode = 0;
-
-    while (display_text[index] != 0) {
-        if (display_text[index] == ':') {
-            mode = 1;
-        } else if (display_text[index] == '.') {
-            mode = 2;
-        } else if (mode == 0) {
-            host[host_index] = display_text[index];
-            host_index++;
-        } else if (mode == 1) {
-            disp[disp_index] = display_text[index];
-            disp_index++;
-        } else if (mode == 2) {
-            scre[scre_index] = display_text[index];
-            scre_index++;
-        }
-        index++;
-    }
-
-    host[host_index] = 0;
-    disp[disp_index] = 0;
-    scre[scre_index] = 0;
-    display_num = atoi(disp);
-    return display_num;
-}
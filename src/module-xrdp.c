@@ -0,0 +1,265 @@
+/***
+  pulse module loading the xrdp sink and source together
+
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/rtclock.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/modargs.h>
+#include <pulsecore/module.h>
+#include <pulsecore/namereg.h>
+#include <pulsecore/sink.h>
+#include <pulsecore/source.h>
+
+/* defined in pulse/version.h */
+#if PA_PROTOCOL_VERSION > 28
+/* these used to be defined in pulsecore/macro.h */
+typedef bool pa_bool_t;
+#define FALSE ((pa_bool_t) 0)
+#define TRUE (!FALSE)
+#else
+#endif
+
+#include "module-xrdp-symdef.h"
+
+PA_MODULE_AUTHOR("Jay Sorg");
+PA_MODULE_DESCRIPTION("xrdp sink and source");
+PA_MODULE_VERSION(PACKAGE_VERSION);
+PA_MODULE_LOAD_ONCE(FALSE);
+PA_MODULE_USAGE(
+        "sink_name=<name for the sink> "
+        "source_name=<name for the source> "
+        "xrdp_socket_path=<path to chansrv sockets> "
+        "xrdp_pulse_sink_socket=<name of the sink socket> "
+        "xrdp_pulse_source_socket=<name of the source socket> "
+        "sink_args=<more arguments for module-xrdp-sink> "
+        "source_args=<more arguments for module-xrdp-source> "
+        "set_default=<make the sink and source the defaults, default true>");
+
+#define DEFAULT_SINK_NAME "xrdp-sink"
+#define DEFAULT_SOURCE_NAME "xrdp-source"
+
+struct userdata {
+    uint32_t sink_module; /* index or PA_INVALID_INDEX */
+    uint32_t source_module;
+};
+
+static const char* const valid_modargs[] = {
+    "sink_name",
+    "source_name",
+    "xrdp_socket_path",
+    "xrdp_pulse_sink_socket",
+    "xrdp_pulse_source_socket",
+    "sink_args",
+    "source_args",
+    "set_default",
+    NULL
+};
+
+/* adds " key='value'" when the modarg is set */
+static char *append_arg(char *args, pa_modargs *ma, const char *key) {
+    const char *value;
+    char *t;
+
+    if (!(value = pa_modargs_get_value(ma, key, NULL))) {
+        return args;
+    }
+    t = pa_sprintf_malloc("%s %s='%s'", args, key, value);
+    pa_xfree(args);
+    return t;
+}
+
+/* adds the modarg as it is, for passing arguments through */
+static char *append_extra(char *args, pa_modargs *ma, const char *key) {
+    const char *value;
+    char *t;
+
+    if (!(value = pa_modargs_get_value(ma, key, NULL))) {
+        return args;
+    }
+    t = pa_sprintf_malloc("%s %s", args, value);
+    pa_xfree(args);
+    return t;
+}
+
+/* loads one of the xrdp modules, PA_INVALID_INDEX on failure */
+static uint32_t load_child(pa_core *c, const char *name, const char *args) {
+    pa_module *m;
+
+    pa_log_debug("loading %s %s", name, args);
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(11, 99, 1)
+    if (pa_module_load(&m, c, name, args) < 0) {
+        m = NULL;
+    }
+#else
+    m = pa_module_load(c, name, args);
+#endif
+    if (m == NULL) {
+        pa_log("Failed to load %s", name);
+        return PA_INVALID_INDEX;
+    }
+    return m->index;
+}
+
+static void set_default_sink(pa_core *c, pa_sink *s) {
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(12, 99, 1)
+    pa_core_set_configured_default_sink(c, s->name);
+#elif defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(10, 99, 1)
+    pa_core_set_configured_default_sink(c, s);
+#else
+    pa_namereg_set_default_sink(c, s);
+#endif
+}
+
+static void set_default_source(pa_core *c, pa_source *s) {
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(12, 99, 1)
+    pa_core_set_configured_default_source(c, s->name);
+#elif defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(10, 99, 1)
+    pa_core_set_configured_default_source(c, s);
+#else
+    pa_namereg_set_default_source(c, s);
+#endif
+}
+
+/* how long it took from pa__init() until the device was usable,
+ * shows up next to the xrdp.stats.* the modules publish */
+static pa_proplist *startup_proplist(pa_usec_t usec) {
+    pa_proplist *pl;
+
+    pl = pa_proplist_new();
+    pa_proplist_setf(pl, "xrdp.stats.startup_usec", "%llu",
+                     (unsigned long long) usec);
+    return pl;
+}
+
+int pa__init(pa_module *m) {
+    struct userdata *u;
+    pa_modargs *ma = NULL;
+    pa_proplist *pl;
+    pa_sink *sink;
+    pa_source *source;
+    const char *sink_name;
+    const char *source_name;
+    char *args;
+    pa_bool_t set_default;
+    pa_usec_t start;
+    pa_usec_t usec;
+
+    pa_assert(m);
+
+    start = pa_rtclock_now();
+    m->userdata = u = pa_xnew0(struct userdata, 1);
+    u->sink_module = PA_INVALID_INDEX;
+    u->source_module = PA_INVALID_INDEX;
+
+    if (!(ma = pa_modargs_new(m->argument, valid_modargs))) {
+        pa_log("Failed to parse module arguments.");
+        goto fail;
+    }
+    set_default = TRUE;
+    if (pa_modargs_get_value_boolean(ma, "set_default", &set_default) < 0) {
+        pa_log("Failed to parse set_default value.");
+        goto fail;
+    }
+    sink_name = pa_modargs_get_value(ma, "sink_name", DEFAULT_SINK_NAME);
+    source_name = pa_modargs_get_value(ma, "source_name", DEFAULT_SOURCE_NAME);
+
+    /* one load instead of a pactl round trip per module and default,
+     * neither module touches a socket before its IO thread needs it */
+    args = pa_sprintf_malloc("sink_name='%s'", sink_name);
+    args = append_arg(args, ma, "xrdp_socket_path");
+    args = append_arg(args, ma, "xrdp_pulse_sink_socket");
+    args = append_extra(args, ma, "sink_args");
+    u->sink_module = load_child(m->core, "module-xrdp-sink", args);
+    pa_xfree(args);
+    if (u->sink_module == PA_INVALID_INDEX) {
+        goto fail;
+    }
+    if ((sink = pa_namereg_get(m->core, sink_name, PA_NAMEREG_SINK))) {
+        if (set_default) {
+            set_default_sink(m->core, sink);
+        }
+        usec = pa_rtclock_now() - start;
+        pa_log_info("%s ready after %llu usec", sink_name,
+                    (unsigned long long) usec);
+        pl = startup_proplist(usec);
+        pa_sink_update_proplist(sink, PA_UPDATE_REPLACE, pl);
+        pa_proplist_free(pl);
+    }
+
+    args = pa_sprintf_malloc("source_name='%s'", source_name);
+    args = append_arg(args, ma, "xrdp_socket_path");
+    args = append_arg(args, ma, "xrdp_pulse_source_socket");
+    args = append_extra(args, ma, "source_args");
+    u->source_module = load_child(m->core, "module-xrdp-source", args);
+    pa_xfree(args);
+    if (u->source_module == PA_INVALID_INDEX) {
+        goto fail;
+    }
+    if ((source = pa_namereg_get(m->core, source_name, PA_NAMEREG_SOURCE))) {
+        if (set_default) {
+            set_default_source(m->core, source);
+        }
+        pl = startup_proplist(pa_rtclock_now() - start);
+        pa_source_update_proplist(source, PA_UPDATE_REPLACE, pl);
+        pa_proplist_free(pl);
+    }
+
+    pa_modargs_free(ma);
+
+    return 0;
+
+fail:
+    if (ma) {
+        pa_modargs_free(ma);
+    }
+
+    pa__done(m);
+
+    return -1;
+}
+
+void pa__done(pa_module *m) {
+    struct userdata *u;
+
+    pa_assert(m);
+
+    if (!(u = m->userdata))
+        return;
+
+    /* the modules may be gone already, unloading an old index does
+     * nothing */
+    if (u->source_module != PA_INVALID_INDEX)
+        pa_module_unload_request_by_index(m->core, u->source_module, TRUE);
+    if (u->sink_module != PA_INVALID_INDEX)
+        pa_module_unload_request_by_index(m->core, u->sink_module, TRUE);
+
+    pa_xfree(u);
+}
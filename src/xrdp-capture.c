@@ -0,0 +1,170 @@
+/***
+  capture of the traffic on the xrdp audio sockets
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-capture.h"
+
+#define PAD8(x) (((x) + 7) & ~((size_t) 7))
+
+int xrdp_capture_open(struct xrdp_capture *c, const char *path,
+                      size_t max_bytes, int payload, const pa_sample_spec *ss) {
+    struct xrdp_capture_header h;
+    int flags;
+    int fd;
+    int err;
+
+    memset(c, 0, sizeof(*c));
+    max_bytes = MAX(max_bytes, sizeof(h));
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+        pa_log("xrdp_capture_open: can't open %s: %s", path, pa_cstrerror(errno));
+        return -1;
+    }
+    /* allocate the blocks now, a sparse file would fault them in from
+     * the IO thread */
+    if ((err = posix_fallocate(fd, 0, max_bytes)) != 0) {
+        pa_log("xrdp_capture_open: can't size %s: %s", path, pa_cstrerror(err));
+        close(fd);
+        return -1;
+    }
+    flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    c->map = mmap(NULL, max_bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+    /* the mapping keeps the file */
+    close(fd);
+    if (c->map == MAP_FAILED) {
+        pa_log("xrdp_capture_open: can't map %s: %s", path, pa_cstrerror(errno));
+        c->map = NULL;
+        return -1;
+    }
+
+#ifndef MAP_POPULATE
+    /* touch every page while we are still in pa__init */
+    memset(c->map, 0, max_bytes);
+#endif
+    c->size = max_bytes;
+    c->flags = payload ? XRDP_CAPTURE_FLAG_PAYLOAD : 0;
+    c->start_usec = pa_rtclock_now();
+    c->path = pa_xstrdup(path);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, XRDP_CAPTURE_MAGIC, sizeof(h.magic));
+    h.flags = c->flags;
+    h.rate = ss->rate;
+    h.channels = ss->channels;
+    h.format = (uint8_t) ss->format;
+    h.start_usec = c->start_usec;
+    memcpy(c->map, &h, sizeof(h));
+    c->used = sizeof(h);
+
+    pa_log_info("capturing to %s, up to %lu bytes%s", path,
+                (unsigned long) max_bytes, payload ? " with payload" : "");
+    return 0;
+}
+
+void xrdp_capture_close(struct xrdp_capture *c) {
+    if (c->map) {
+        munmap(c->map, c->size);
+        c->map = NULL;
+        /* drop the unused tail */
+        if (truncate(c->path, c->used) != 0) {
+            pa_log("xrdp_capture_close: can't truncate %s: %s", c->path,
+                   pa_cstrerror(errno));
+        }
+        pa_log_info("xrdp_capture_close: %llu records in %s, %llu did not fit",
+                    (unsigned long long) c->records, c->path,
+                    (unsigned long long) c->overflow);
+    }
+    pa_xfree(c->path);
+    c->path = NULL;
+}
+
+void xrdp_capture_add(struct xrdp_capture *c, int kind, int code,
+                      uint32_t bytes, const void *payload, size_t payload_bytes) {
+    struct xrdp_capture_record r;
+    size_t need;
+
+    if (c->map == NULL) {
+        return;
+    }
+    if (!(c->flags & XRDP_CAPTURE_FLAG_PAYLOAD) || payload == NULL) {
+        payload_bytes = 0;
+    }
+    need = sizeof(r) + PAD8(payload_bytes);
+    if (c->size - c->used < need) {
+        c->overflow++;
+        return;
+    }
+
+    r.usec = pa_rtclock_now() - c->start_usec;
+    r.kind = (uint8_t) kind;
+    r.reserved = 0;
+    r.reserved2 = 0;
+    r.code = code;
+    r.bytes = bytes;
+    r.payload_bytes = (uint32_t) payload_bytes;
+    memcpy(c->map + c->used, &r, sizeof(r));
+    if (payload_bytes > 0) {
+        memcpy(c->map + c->used + sizeof(r), payload, payload_bytes);
+    }
+    c->used += need;
+    c->records++;
+}
+
+const struct xrdp_capture_record *
+xrdp_capture_next(const char *map, size_t size, size_t *off,
+                  const char **payload) {
+    const struct xrdp_capture_record *r;
+
+    if (*off == 0) {
+        *off = sizeof(struct xrdp_capture_header);
+    }
+    if (size < *off || size - *off < sizeof(*r)) {
+        return NULL;
+    }
+    /* records stay 8 byte aligned in the mapping */
+    r = (const struct xrdp_capture_record *) (map + *off);
+    if (r->kind == 0 ||
+        size - *off - sizeof(*r) < PAD8((size_t) r->payload_bytes)) {
+        return NULL;
+    }
+    *payload = map + *off + sizeof(*r);
+    *off += sizeof(*r) + PAD8((size_t) r->payload_bytes);
+    return r;
+}
@@ -0,0 +1,101 @@
+/***
+  capture of the traffic on the xrdp audio sockets
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_CAPTURE_H
+#define XRDP_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pulse/sample.h>
+
+/*
+ * With capture_file= the IO thread appends a record for every frame on
+ * the sink socket, every feedback message, and every source command and
+ * reply to a memory mapped file. Adding a record is a memcpy, nothing
+ * reaches the kernel until the pages are written back. Once the file is
+ * full, further records are only counted.
+ *
+ * The file is a struct xrdp_capture_header followed by records, each a
+ * struct xrdp_capture_record and its payload padded to 8 bytes, all in
+ * host byte order. A record with kind 0 or the end of the file ends it.
+ * bench/xrdp-bench -R replays a capture.
+ */
+
+#define XRDP_CAPTURE_MAGIC "XRDPCAP1"
+/* records carry the payload, not only its length */
+#define XRDP_CAPTURE_FLAG_PAYLOAD 1
+
+enum xrdp_capture_kind {
+    XRDP_CAPTURE_SINK_FRAME = 1, /* module to chansrv, code and bytes of the header */
+    XRDP_CAPTURE_SINK_FEEDBACK, /* chansrv to module, likewise */
+    XRDP_CAPTURE_SOURCE_CMD, /* code is the command, bytes its parameter */
+    XRDP_CAPTURE_SOURCE_DATA /* reply to READ or streamed, bytes is the length */
+};
+
+struct xrdp_capture_header {
+    char magic[8];
+    uint32_t flags;
+    uint32_t rate;
+    uint8_t channels;
+    uint8_t format; /* pa_sample_format_t of the wire */
+    uint16_t reserved;
+    uint32_t reserved2;
+    uint64_t start_usec; /* pa_rtclock_now() at open */
+};
+
+struct xrdp_capture_record {
+    uint64_t usec; /* since start_usec */
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t reserved2;
+    int32_t code;
+    uint32_t bytes;
+    uint32_t payload_bytes; /* what follows, before padding */
+};
+
+struct xrdp_capture {
+    char *map; /* NULL unless capturing */
+    size_t size;
+    size_t used;
+    int flags;
+    uint64_t start_usec;
+    uint64_t records;
+    uint64_t overflow; /* records that did not fit */
+    char *path;
+};
+
+/* maps a file of max_bytes, allocated and faulted in up front so adding
+ * records takes no page faults. Returns -1 if that fails. A zeroed
+ * struct that was never opened is fine for every other call */
+int xrdp_capture_open(struct xrdp_capture *c, const char *path,
+                      size_t max_bytes, int payload, const pa_sample_spec *ss);
+void xrdp_capture_close(struct xrdp_capture *c);
+void xrdp_capture_add(struct xrdp_capture *c, int kind, int code,
+                      uint32_t bytes, const void *payload, size_t payload_bytes);
+
+/* walk the records of a mapped capture, *off starts at 0. Returns NULL
+ * at the end, *payload points into 'map' */
+const struct xrdp_capture_record *
+xrdp_capture_next(const char *map, size_t size, size_t *off,
+                  const char **payload);
+
+#endif
@@ -0,0 +1,191 @@
+/***
+  helpers shared by the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+
+#include "xrdp-common.h"
+
+int xrdp_get_display_num(const char *display_text) {
+    int index;
+    int mode;
+    int host_index;
+    int disp_index;
+    int scre_index;
+    int display_num;
+    char host[256];
+    char disp[256];
+    char scre[256];
+
+    if (display_text == NULL) {
+        return 0;
+    }
+    memset(host, 0, 256);
+    memset(disp, 0, 256);
+    memset(scre, 0, 256);
+
+    index = 0;
+    host_index = 0;
+    disp_index = 0;
+    scre_index = 0;
+    mode = 0;
+
+    while (display_text[index] != 0) {
+        if (display_text[index] == ':') {
+            mode = 1;
+        } else if (display_text[index] == '.') {
+            mode = 2;
+        } else if (mode == 0) {
+            host[host_index] = display_text[index];
+            host_index++;
+        } else if (mode == 1) {
+            disp[disp_index] = display_text[index];
+            disp_index++;
+        } else if (mode == 2) {
+            scre[scre_index] = display_text[index];
+            scre_index++;
+        }
+        index++;
+    }
+
+    host[host_index] = 0;
+    disp[disp_index] = 0;
+    scre[scre_index] = 0;
+    display_num = atoi(disp);
+    return display_num;
+}
+
+char *xrdp_socket_path(pa_modargs *ma, const char *name_arg,
+                       const char *name_env, const char *default_fmt) {
+    const char *socket_dir;
+    const char *socket_name;
+    char default_socket_name[64];
+    char *path;
+    size_t nbytes;
+
+    socket_dir = pa_modargs_get_value(ma, "xrdp_socket_path",
+                                      getenv("XRDP_SOCKET_PATH"));
+    if (socket_dir == NULL || socket_dir[0] == '\0') {
+        socket_dir = "/tmp/.xrdp";
+    }
+
+    socket_name = pa_modargs_get_value(ma, name_arg, getenv(name_env));
+    if (socket_name == NULL || socket_name[0] == '\0')
+    {
+        int display_num = xrdp_get_display_num(getenv("DISPLAY"));
+
+        pa_log_debug("Could not obtain %s from environment.", name_env);
+        snprintf(default_socket_name, sizeof(default_socket_name),
+                 default_fmt, display_num);
+        socket_name = default_socket_name;
+    }
+
+    nbytes = strlen(socket_dir) + 1 + strlen(socket_name) + 1;
+    path = pa_xmalloc(nbytes);
+    snprintf(path, nbytes, "%s/%s", socket_dir, socket_name);
+    return path;
+}
+
+pa_device_port *xrdp_create_port(pa_core *core, const char *name,
+                                 const char *description,
+                                 pa_direction_t direction) {
+    pa_device_port_new_data data;
+    pa_device_port *port;
+
+    pa_device_port_new_data_init(&data);
+
+    pa_device_port_new_data_set_name(&data, name);
+    pa_device_port_new_data_set_description(&data, description);
+    pa_device_port_new_data_set_direction(&data, direction);
+    pa_device_port_new_data_set_available(&data, PA_AVAILABLE_YES);
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(14, 0, 0)
+    pa_device_port_new_data_set_type(&data, PA_DEVICE_PORT_TYPE_NETWORK);
+#endif
+
+    port = pa_device_port_new(core, &data, 0);
+
+    pa_device_port_new_data_done(&data);
+
+    if (port == NULL)
+    {
+        return NULL;
+    }
+
+    pa_device_port_ref(port);
+
+    return port;
+}
+
+pa_card *xrdp_create_card(pa_module *m, const char *driver, const char *name,
+                          pa_device_port *port, pa_card_profile *profile) {
+    pa_card_new_data data;
+    pa_card *card;
+
+    pa_card_new_data_init(&data);
+    data.driver = driver;
+
+    pa_card_new_data_set_name(&data, name);
+
+    pa_hashmap_put(data.ports, port->name, port);
+    pa_hashmap_put(data.profiles, profile->name, profile);
+
+    card = pa_card_new(m->core, &data);
+
+    pa_card_new_data_done(&data);
+
+    if (card == NULL)
+    {
+        return NULL;
+    }
+
+    pa_card_choose_initial_profile(card);
+
+    pa_card_put(card);
+
+    return card;
+}
+
+void xrdp_set_timer_slack(pa_usec_t usec) {
+#ifdef __linux__
+    /* the slack is in nsec and per thread */
+    if (prctl(PR_SET_TIMERSLACK, (unsigned long) (usec * 1000), 0, 0, 0) != 0) {
+        pa_log_debug("PR_SET_TIMERSLACK failed: %s", pa_cstrerror(errno));
+    }
+#else
+    (void) usec;
+#endif
+}
@@ -0,0 +1,53 @@
+/***
+  helpers shared by the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_COMMON_H
+#define XRDP_COMMON_H
+
+#include <pulsecore/card.h>
+#include <pulsecore/device-port.h>
+#include <pulsecore/modargs.h>
+#include <pulsecore/module.h>
+
+/* display number from a DISPLAY value like "host:10.0", 0 if unset */
+int xrdp_get_display_num(const char *display_text);
+
+/* chansrv socket path from the xrdp_socket_path modarg or
+ * XRDP_SOCKET_PATH and the 'name_arg' modarg or 'name_env'. Without a
+ * name 'default_fmt' is used with the display number. Free with
+ * pa_xfree() */
+char *xrdp_socket_path(pa_modargs *ma, const char *name_arg,
+                       const char *name_env, const char *default_fmt);
+
+/* a referenced network port that is always available */
+pa_device_port *xrdp_create_port(pa_core *core, const char *name,
+                                 const char *description,
+                                 pa_direction_t direction);
+/* a card holding one port and one profile, NULL on failure */
+pa_card *xrdp_create_card(pa_module *m, const char *driver, const char *name,
+                          pa_device_port *port, pa_card_profile *profile);
+
+/* let the kernel fire the calling thread's timers up to 'usec' late so
+ * they can share a wakeup with other timers, 0 restores the default.
+ * Does nothing outside Linux */
+void xrdp_set_timer_slack(pa_usec_t usec);
+
+#endif
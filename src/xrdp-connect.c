@@ -0,0 +1,301 @@
+/***
+  chansrv connection state machine for xrdp
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <pulse/rtclock.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-connect.h"
+
+/* set up on the first failed attempt, a session that finds chansrv
+ * right away never needs it */
+static void watch_init(struct xrdp_connect *c) {
+#ifdef __linux__
+    struct pollfd *pollfd;
+
+    if (c->watch_tried) {
+        return;
+    }
+    c->watch_tried = 1;
+    /* only useful with a directory to watch */
+    if (c->name == c->path) {
+        return;
+    }
+    c->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (c->inotify_fd < 0) {
+        pa_log_debug("xrdp_connect: inotify_init1 failed: %s", pa_cstrerror(errno));
+        return;
+    }
+    c->inotify_item = pa_rtpoll_item_new(c->rtpoll, PA_RTPOLL_NEVER, 1);
+    pollfd = pa_rtpoll_item_get_pollfd(c->inotify_item, NULL);
+    pollfd->fd = c->inotify_fd;
+    pollfd->events = POLLIN;
+    pollfd->revents = 0;
+#else
+    (void) c;
+#endif
+}
+
+static void watch_dir(struct xrdp_connect *c) {
+#ifdef __linux__
+    char *dir;
+
+    watch_init(c);
+    if (c->inotify_fd < 0 || c->watch >= 0) {
+        return;
+    }
+    /* the directory may not exist before xrdp starts, this is retried
+     * after every failed attempt */
+    dir = pa_xstrndup(c->path, c->name - c->path);
+    c->watch = inotify_add_watch(c->inotify_fd, dir[0] ? dir : "/",
+                                 IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    pa_xfree(dir);
+#else
+    (void) c;
+#endif
+}
+
+/* connected, other sessions creating their sockets in the same
+ * directory must not wake this thread. Armed again on failure */
+static void unwatch_dir(struct xrdp_connect *c) {
+#ifdef __linux__
+    if (c->watch >= 0) {
+        inotify_rm_watch(c->inotify_fd, c->watch);
+        c->watch = -1;
+    }
+#else
+    (void) c;
+#endif
+}
+
+static void schedule_retry(struct xrdp_connect *c, pa_usec_t now) {
+    pa_usec_t delay;
+
+    /* equal jitter, between half and all of the backoff */
+    delay = c->backoff / 2 + (pa_usec_t) rand_r(&c->seed) % (c->backoff / 2 + 1);
+    c->next_attempt = now + delay;
+    c->backoff = MIN(c->backoff * 2, XRDP_CONNECT_BACKOFF_MAX_USEC);
+    pa_log_debug("xrdp_connect: retrying %s in %llu ms", c->path,
+                 (unsigned long long) (delay / PA_USEC_PER_MSEC));
+    watch_dir(c);
+}
+
+static void close_attempt(struct xrdp_connect *c) {
+    if (c->connect_item) {
+        pa_rtpoll_item_free(c->connect_item);
+        c->connect_item = NULL;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->connected = 0;
+}
+
+static void start_attempt(struct xrdp_connect *c, pa_usec_t now) {
+    struct sockaddr_un s;
+    struct pollfd *pollfd;
+    int fd;
+
+    fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0) {
+        pa_log("xrdp_connect: socket failed: %s", pa_cstrerror(errno));
+        schedule_retry(c, now);
+        return;
+    }
+    pa_make_fd_nonblock(fd);
+
+    memset(&s, 0, sizeof(s));
+    s.sun_family = AF_UNIX;
+    pa_strlcpy(s.sun_path, c->path, sizeof(s.sun_path));
+    pa_log_debug("xrdp_connect: trying to connect to %s", s.sun_path);
+
+    c->fd = fd;
+    if (connect(fd, (struct sockaddr *) &s, sizeof(s)) == 0) {
+        c->connected = 1;
+        return;
+    }
+    if (errno == EINPROGRESS) {
+        c->connect_item = pa_rtpoll_item_new(c->rtpoll, PA_RTPOLL_NEVER, 1);
+        pollfd = pa_rtpoll_item_get_pollfd(c->connect_item, NULL);
+        pollfd->fd = fd;
+        pollfd->events = POLLOUT;
+        pollfd->revents = 0;
+        return;
+    }
+
+    /* ENOENT and ECONNREFUSED while chansrv is down, EAGAIN when its
+     * listen backlog is full */
+    pa_log_debug("xrdp_connect: connect failed: %s", pa_cstrerror(errno));
+    close_attempt(c);
+    schedule_retry(c, now);
+}
+
+void xrdp_connect_init(struct xrdp_connect *c, pa_rtpoll *rtpoll, const char *path) {
+    const char *slash;
+
+    memset(c, 0, sizeof(*c));
+    c->rtpoll = rtpoll;
+    c->path = pa_xstrdup(path);
+    slash = strrchr(c->path, '/');
+    c->name = slash ? slash + 1 : c->path;
+    c->fd = -1;
+    c->backoff = XRDP_CONNECT_BACKOFF_MIN_USEC;
+    c->seed = (unsigned int) (getpid() ^ pa_rtclock_now());
+    c->inotify_fd = -1;
+    c->watch = -1;
+    /* nothing touches the file system before the first attempt */
+}
+
+void xrdp_connect_done(struct xrdp_connect *c) {
+    if (c->path == NULL) {
+        /* never set up */
+        return;
+    }
+    close_attempt(c);
+    if (c->inotify_item) {
+        pa_rtpoll_item_free(c->inotify_item);
+        c->inotify_item = NULL;
+    }
+    if (c->inotify_fd >= 0) {
+        close(c->inotify_fd);
+        c->inotify_fd = -1;
+    }
+    pa_xfree(c->path);
+    c->path = NULL;
+}
+
+int xrdp_connect_get(struct xrdp_connect *c, pa_usec_t now) {
+    int fd;
+    int flags;
+
+    if (!c->connected && c->fd < 0 && now >= c->next_attempt) {
+        start_attempt(c, now);
+    }
+    if (!c->connected) {
+        return -1;
+    }
+
+    /* hand over a blocking fd, like a plain connect() would */
+    fd = c->fd;
+    if ((flags = fcntl(fd, F_GETFL)) >= 0) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    c->fd = -1;
+    c->connected = 0;
+    c->backoff = XRDP_CONNECT_BACKOFF_MIN_USEC;
+    unwatch_dir(c);
+    pa_log("xrdp_connect: connected to %s, fd %d", c->path, fd);
+    return fd;
+}
+
+void xrdp_connect_failed(struct xrdp_connect *c, pa_usec_t now) {
+    close_attempt(c);
+    schedule_retry(c, now);
+}
+
+void xrdp_connect_process(struct xrdp_connect *c) {
+    struct pollfd *pollfd;
+    socklen_t len;
+    int err;
+
+    if (c->connect_item) {
+        pollfd = pa_rtpoll_item_get_pollfd(c->connect_item, NULL);
+        if (pollfd->revents) {
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+                err = errno;
+            }
+            pa_rtpoll_item_free(c->connect_item);
+            c->connect_item = NULL;
+            if (err == 0) {
+                c->connected = 1;
+            } else {
+                pa_log_debug("xrdp_connect: connect failed: %s", pa_cstrerror(err));
+                close_attempt(c);
+                schedule_retry(c, pa_rtclock_now());
+            }
+        }
+    }
+
+#ifdef __linux__
+    if (c->inotify_item) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        ssize_t got;
+        ssize_t i;
+
+        pollfd = pa_rtpoll_item_get_pollfd(c->inotify_item, NULL);
+        if (!(pollfd->revents & POLLIN)) {
+            return;
+        }
+        while ((got = read(c->inotify_fd, buf, sizeof(buf))) > 0) {
+            for (i = 0; i < got; i += sizeof(*ev) + ev->len) {
+                ev = (const struct inotify_event *) (buf + i);
+                if (ev->mask & IN_IGNORED) {
+                    /* the directory went away, or an old watch we removed */
+                    if (ev->wd == c->watch) {
+                        c->watch = -1;
+                    }
+                } else if (ev->len > 0 && strcmp(ev->name, c->name) == 0 &&
+                           c->fd < 0) {
+                    pa_log_debug("xrdp_connect: %s appeared", c->path);
+                    c->backoff = XRDP_CONNECT_BACKOFF_MIN_USEC;
+                    c->next_attempt = 0;
+                }
+            }
+        }
+    }
+#endif
+}
+
+pa_usec_t xrdp_connect_next_attempt(const struct xrdp_connect *c) {
+    if (c->connected || (c->fd < 0 && c->next_attempt == 0)) {
+        return pa_rtclock_now();
+    }
+    if (c->fd >= 0) {
+        /* connect_item wakes us up */
+        return 0;
+    }
+    return c->next_attempt;
+}
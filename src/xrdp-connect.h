@@ -0,0 +1,73 @@
+/***
+  chansrv connection state machine for xrdp
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_CONNECT_H
+#define XRDP_CONNECT_H
+
+#include <pulse/sample.h>
+#include <pulsecore/rtpoll.h>
+
+/* retry delays, doubled after every failed attempt */
+#define XRDP_CONNECT_BACKOFF_MIN_USEC (100 * PA_USEC_PER_MSEC)
+#define XRDP_CONNECT_BACKOFF_MAX_USEC (10 * PA_USEC_PER_SEC)
+
+/*
+ * Connects to a chansrv unix socket without blocking the IO thread.
+ *
+ * A failed attempt is retried after an exponential backoff with jitter,
+ * so sessions don't reconnect in lockstep after an xrdp restart. On
+ * Linux the socket directory is watched with inotify and a new socket
+ * there cuts the backoff short, the watch is only armed while attempts
+ * are failing. Apart from init and done all calls are made from the
+ * IO thread.
+ */
+struct xrdp_connect {
+    pa_rtpoll *rtpoll;
+    char *path;
+    const char *name; /* file name part of path */
+    int fd; /* connect in progress or done, -1 otherwise */
+    int connected; /* fd is ready to be taken by xrdp_connect_get() */
+    pa_rtpoll_item *connect_item; /* POLLOUT while the connect is pending */
+    pa_usec_t backoff;
+    pa_usec_t next_attempt;
+    unsigned int seed;
+    int inotify_fd;
+    int watch_tried; /* inotify set up, or found useless */
+    int watch; /* inotify watch on the socket directory or -1 */
+    pa_rtpoll_item *inotify_item;
+};
+
+void xrdp_connect_init(struct xrdp_connect *c, pa_rtpoll *rtpoll, const char *path);
+/* also fine on a zeroed struct that was never set up */
+void xrdp_connect_done(struct xrdp_connect *c);
+
+/* returns a connected, blocking fd owned by the caller, or -1 while
+ * there is none yet */
+int xrdp_connect_get(struct xrdp_connect *c, pa_usec_t now);
+/* the caller gave up on a connection it got, back off before retrying */
+void xrdp_connect_failed(struct xrdp_connect *c, pa_usec_t now);
+/* call after pa_rtpoll_run(), handles the rtpoll items */
+void xrdp_connect_process(struct xrdp_connect *c);
+/* when xrdp_connect_get() may succeed without an rtpoll event, 0 if
+ * there is nothing to wait for */
+pa_usec_t xrdp_connect_next_attempt(const struct xrdp_connect *c);
+
+#endif
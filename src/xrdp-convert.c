@@ -0,0 +1,412 @@
+/***
+  sample format conversion for the xrdp wire format
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <pulsecore/cpu-x86.h>
+#define XRDP_CONVERT_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#include <pulsecore/cpu-arm.h>
+#define XRDP_CONVERT_NEON
+#endif
+
+#include "xrdp-convert.h"
+
+#define SQRT1_2 0.70710678f
+
+static void float_to_s16_generic(int16_t *dst, const float *src, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        float v = src[i] * 32768.0f;
+
+        v = PA_CLAMP_UNLIKELY(v, -32768.0f, 32767.0f);
+        dst[i] = (int16_t) lrintf(v);
+    }
+}
+
+static void s16_to_float_generic(float *dst, const int16_t *src, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = src[i] * (1.0f / 32768.0f);
+    }
+}
+
+#ifdef XRDP_CONVERT_X86
+__attribute__((target("sse2")))
+static void float_to_s16_sse2(int16_t *dst, const float *src, size_t n) {
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+
+        /* clamp first, out of range values would convert to INT_MIN */
+        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+        b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    float_to_s16_generic(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void s16_to_float_sse2(float *dst, const int16_t *src, size_t n) {
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        /* sign extend by moving each sample into the top half */
+        __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+    }
+    s16_to_float_generic(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(int16_t *dst, const float *src, size_t n) {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+        __m256i r;
+
+        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+        b = _mm256_max_ps(_mm256_min_ps(b, hi), lo);
+        /* packs works per 128 bit lane, put the quads back in order */
+        r = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256((__m256i *) (dst + i), r);
+    }
+    float_to_s16_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void s16_to_float_avx2(float *dst, const int16_t *src, size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (src + i)));
+
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    s16_to_float_generic(dst + i, src + i, n - i);
+}
+#endif /* XRDP_CONVERT_X86 */
+
+#ifdef XRDP_CONVERT_NEON
+static void float_to_s16_neon(int16_t *dst, const float *src, size_t n) {
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        float32x4_t a = vmulq_f32(vld1q_f32(src + i), scale);
+        float32x4_t b = vmulq_f32(vld1q_f32(src + i + 4), scale);
+        int32x4_t ia;
+        int32x4_t ib;
+
+        /* vcvtq truncates and saturates, round half away from zero */
+        a = vbslq_f32(vcltq_f32(a, vdupq_n_f32(0.0f)), vsubq_f32(a, half), vaddq_f32(a, half));
+        b = vbslq_f32(vcltq_f32(b, vdupq_n_f32(0.0f)), vsubq_f32(b, half), vaddq_f32(b, half));
+        ia = vcvtq_s32_f32(a);
+        ib = vcvtq_s32_f32(b);
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+    }
+    float_to_s16_generic(dst + i, src + i, n - i);
+}
+
+static void s16_to_float_neon(float *dst, const int16_t *src, size_t n) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(src + i);
+
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+    }
+    s16_to_float_generic(dst + i, src + i, n - i);
+}
+#endif /* XRDP_CONVERT_NEON */
+
+static void pick_kernels(struct xrdp_convert *c, pa_core *core) {
+    c->float_to_s16 = float_to_s16_generic;
+    c->s16_to_float = s16_to_float_generic;
+    c->impl = "generic";
+
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(2, 0, 0)
+#ifdef XRDP_CONVERT_X86
+    if (core->cpu_info.cpu_type == PA_CPU_X86 &&
+        (core->cpu_info.flags.x86 & PA_CPU_X86_SSE2)) {
+        c->float_to_s16 = float_to_s16_sse2;
+        c->s16_to_float = s16_to_float_sse2;
+        c->impl = "sse2";
+    }
+    __builtin_cpu_init();
+    if (core->cpu_info.cpu_type == PA_CPU_X86 && __builtin_cpu_supports("avx2")) {
+        c->float_to_s16 = float_to_s16_avx2;
+        c->s16_to_float = s16_to_float_avx2;
+        c->impl = "avx2";
+    }
+#endif
+#ifdef XRDP_CONVERT_NEON
+    if (core->cpu_info.cpu_type == PA_CPU_ARM &&
+        (core->cpu_info.flags.arm & PA_CPU_ARM_NEON)) {
+        c->float_to_s16 = float_to_s16_neon;
+        c->s16_to_float = s16_to_float_neon;
+        c->impl = "neon";
+    }
+#endif
+#else
+    (void) core;
+#endif
+}
+
+/* weight of an input channel in the left and right output */
+static void stereo_weights(pa_channel_position_t p, float *l, float *r) {
+    switch (p) {
+        case PA_CHANNEL_POSITION_FRONT_LEFT:
+        case PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER:
+            *l = 1.0f;
+            *r = 0.0f;
+            break;
+        case PA_CHANNEL_POSITION_FRONT_RIGHT:
+        case PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER:
+            *l = 0.0f;
+            *r = 1.0f;
+            break;
+        case PA_CHANNEL_POSITION_REAR_LEFT:
+        case PA_CHANNEL_POSITION_SIDE_LEFT:
+            *l = SQRT1_2;
+            *r = 0.0f;
+            break;
+        case PA_CHANNEL_POSITION_REAR_RIGHT:
+        case PA_CHANNEL_POSITION_SIDE_RIGHT:
+            *l = 0.0f;
+            *r = SQRT1_2;
+            break;
+        case PA_CHANNEL_POSITION_LFE:
+            *l = 0.0f;
+            *r = 0.0f;
+            break;
+        case PA_CHANNEL_POSITION_MONO:
+        case PA_CHANNEL_POSITION_FRONT_CENTER:
+        case PA_CHANNEL_POSITION_REAR_CENTER:
+        default:
+            *l = SQRT1_2;
+            *r = SQRT1_2;
+            break;
+    }
+}
+
+/* build a [out][in] matrix for up to stereo output, anything wider only
+ * passes through with matching layouts */
+static int build_matrix(struct xrdp_convert *c,
+                        const pa_channel_map *from_map,
+                        const pa_channel_map *to_map) {
+    unsigned i;
+    unsigned o;
+    float l;
+    float r;
+    float sum;
+
+    memset(c->matrix, 0, sizeof(c->matrix));
+
+    if (pa_channel_map_equal(from_map, to_map)) {
+        c->mix = 0;
+        return 0;
+    }
+    c->mix = 1;
+
+    if (c->from.channels == 1) {
+        /* upmix, mono goes to every output channel */
+        for (o = 0; o < c->to.channels; o++) {
+            c->matrix[o][0] = 1.0f;
+        }
+        return 0;
+    }
+
+    if (c->to.channels > 2) {
+        return -1;
+    }
+
+    for (i = 0; i < c->from.channels; i++) {
+        stereo_weights(from_map->map[i], &l, &r);
+        if (c->to.channels == 1) {
+            c->matrix[0][i] = (l + r) * 0.5f;
+        } else {
+            c->matrix[0][i] = l;
+            c->matrix[1][i] = r;
+        }
+    }
+
+    /* keep full scale input from clipping */
+    for (o = 0; o < c->to.channels; o++) {
+        sum = 0.0f;
+        for (i = 0; i < c->from.channels; i++) {
+            sum += c->matrix[o][i];
+        }
+        if (sum > 1.0f) {
+            for (i = 0; i < c->from.channels; i++) {
+                c->matrix[o][i] /= sum;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int xrdp_convert_init(struct xrdp_convert *c, pa_core *core,
+                      const pa_sample_spec *from, const pa_channel_map *from_map,
+                      const pa_sample_spec *to, const pa_channel_map *to_map) {
+    memset(c, 0, sizeof(*c));
+
+    if ((from->format != PA_SAMPLE_S16NE && from->format != PA_SAMPLE_FLOAT32NE) ||
+        (to->format != PA_SAMPLE_S16NE && to->format != PA_SAMPLE_FLOAT32NE) ||
+        from->rate != to->rate) {
+        pa_log("xrdp_convert_init: unsupported conversion %s/%u -> %s/%u",
+               pa_sample_format_to_string(from->format), from->rate,
+               pa_sample_format_to_string(to->format), to->rate);
+        return -1;
+    }
+
+    c->from = *from;
+    c->to = *to;
+    if (build_matrix(c, from_map, to_map) != 0) {
+        pa_log("xrdp_convert_init: can't remix %u to %u channels",
+               from->channels, to->channels);
+        return -1;
+    }
+
+    pick_kernels(c, core);
+    c->tmp_in = pa_xnew(float, XRDP_CONVERT_BLOCK_FRAMES * from->channels);
+    c->tmp_out = pa_xnew(float, XRDP_CONVERT_BLOCK_FRAMES * to->channels);
+
+    pa_log_info("converting %s %uch -> %s %uch, %s kernels",
+                pa_sample_format_to_string(from->format), from->channels,
+                pa_sample_format_to_string(to->format), to->channels, c->impl);
+
+    return 0;
+}
+
+void xrdp_convert_done(struct xrdp_convert *c) {
+    pa_xfree(c->tmp_in);
+    pa_xfree(c->tmp_out);
+    c->tmp_in = NULL;
+    c->tmp_out = NULL;
+}
+
+size_t xrdp_convert_out_bytes(const struct xrdp_convert *c, size_t bytes) {
+    return bytes / pa_frame_size(&c->from) * pa_frame_size(&c->to);
+}
+
+static void mix(const struct xrdp_convert *c, float *dst, const float *src,
+                size_t frames) {
+    unsigned ic = c->from.channels;
+    unsigned oc = c->to.channels;
+    size_t f;
+    unsigned o;
+    unsigned i;
+
+    for (f = 0; f < frames; f++) {
+        for (o = 0; o < oc; o++) {
+            float acc = 0.0f;
+
+            for (i = 0; i < ic; i++) {
+                acc += c->matrix[o][i] * src[f * ic + i];
+            }
+            dst[f * oc + o] = acc;
+        }
+    }
+}
+
+void xrdp_convert_run(struct xrdp_convert *c, void *dst, const void *src,
+                      size_t bytes) {
+    size_t frames = bytes / pa_frame_size(&c->from);
+    size_t ic = c->from.channels;
+    size_t oc = c->to.channels;
+    const char *in = src;
+    char *out = dst;
+    const float *fin;
+    const float *fout;
+    size_t n;
+
+    while (frames > 0) {
+        n = MIN(frames, XRDP_CONVERT_BLOCK_FRAMES);
+
+        if (c->from.format == PA_SAMPLE_FLOAT32NE) {
+            fin = (const float *) in;
+        } else {
+            c->s16_to_float(c->tmp_in, (const int16_t *) in, n * ic);
+            fin = c->tmp_in;
+        }
+
+        if (c->mix) {
+            mix(c, c->tmp_out, fin, n);
+            fout = c->tmp_out;
+        } else {
+            fout = fin;
+        }
+
+        if (c->to.format == PA_SAMPLE_FLOAT32NE) {
+            if (fout != (const float *) out) {
+                memcpy(out, fout, n * oc * sizeof(float));
+            }
+        } else {
+            c->float_to_s16((int16_t *) out, fout, n * oc);
+        }
+
+        in += n * pa_frame_size(&c->from);
+        out += n * pa_frame_size(&c->to);
+        frames -= n;
+    }
+}
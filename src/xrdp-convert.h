@@ -0,0 +1,66 @@
+/***
+  sample format conversion for the xrdp wire format
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_CONVERT_H
+#define XRDP_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pulse/sample.h>
+#include <pulse/channelmap.h>
+#include <pulsecore/core.h>
+
+/* frames converted per pass, bounds the scratch buffers */
+#define XRDP_CONVERT_BLOCK_FRAMES 256
+
+typedef void (*xrdp_float_to_s16_func_t)(int16_t *dst, const float *src, size_t n);
+typedef void (*xrdp_s16_to_float_func_t)(float *dst, const int16_t *src, size_t n);
+
+/*
+ * Converts interleaved S16NE or FLOAT32NE audio between two sample specs
+ * of the same rate, remixing channels on the way. The float <-> S16
+ * kernels are picked from the CPU features when the converter is set up.
+ */
+struct xrdp_convert {
+    pa_sample_spec from;
+    pa_sample_spec to;
+    int mix; /* 0 if the channel layout passes through unchanged */
+    float matrix[PA_CHANNELS_MAX][PA_CHANNELS_MAX]; /* [out][in] */
+    float *tmp_in;
+    float *tmp_out;
+    xrdp_float_to_s16_func_t float_to_s16;
+    xrdp_s16_to_float_func_t s16_to_float;
+    const char *impl; /* name of the kernels in use */
+};
+
+/* returns -1 if either spec is not S16NE or FLOAT32NE or rates differ */
+int xrdp_convert_init(struct xrdp_convert *c, pa_core *core,
+                      const pa_sample_spec *from, const pa_channel_map *from_map,
+                      const pa_sample_spec *to, const pa_channel_map *to_map);
+void xrdp_convert_done(struct xrdp_convert *c);
+
+/* size of the converted data for 'bytes' of input */
+size_t xrdp_convert_out_bytes(const struct xrdp_convert *c, size_t bytes);
+void xrdp_convert_run(struct xrdp_convert *c, void *dst, const void *src,
+                      size_t bytes);
+
+#endif
@@ -0,0 +1,186 @@
+/***
+  capture clock drift compensation for the xrdp source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-drift.h"
+
+/* weight of a sample halves after this many seconds */
+#define HALF_LIFE_SEC 60.0
+/* fastest change of the ratio in use, per second of audio */
+#define SLEW_PER_SEC 20e-6
+
+int xrdp_drift_init(struct xrdp_drift *d, const pa_sample_spec *ss) {
+    memset(d, 0, sizeof(*d));
+    if (ss->format != PA_SAMPLE_S16NE && ss->format != PA_SAMPLE_FLOAT32NE) {
+        return -1;
+    }
+    d->ss = *ss;
+    xrdp_drift_reset(d);
+    return 0;
+}
+
+void xrdp_drift_reset(struct xrdp_drift *d) {
+    d->t0 = 0;
+    d->last = 0;
+    d->sw = d->st = d->sf = d->stt = d->stf = 0;
+    d->frames = 0;
+    d->ratio = 1.0;
+    d->pos = 0;
+    d->have_prev = 0;
+}
+
+/* ratio the estimate asks for, 0 while there is not enough of it */
+static double target_ratio(const struct xrdp_drift *d) {
+    double den;
+    double slope;
+    double ratio;
+    double limit = XRDP_DRIFT_MAX_PPM / 1e6;
+
+    if (d->last - d->t0 < XRDP_DRIFT_MIN_SPAN_USEC) {
+        return 0;
+    }
+    den = d->sw * d->stt - d->st * d->st;
+    if (den <= 0) {
+        return 0;
+    }
+    /* client frames per local second */
+    slope = (d->sw * d->stf - d->st * d->sf) / den;
+    if (slope <= 0) {
+        return 0;
+    }
+    ratio = d->ss.rate / slope;
+    return PA_CLAMP(ratio, 1.0 - limit, 1.0 + limit);
+}
+
+void xrdp_drift_update(struct xrdp_drift *d, pa_usec_t now, size_t frames) {
+    double t;
+    double decay;
+    double target;
+    double step;
+
+    if (d->last != 0 && now - d->last > XRDP_DRIFT_GAP_USEC) {
+        /* the client stopped sending for a while, the old fit says
+         * nothing about the new stream. Keep the ratio in use */
+        double ratio = d->ratio;
+
+        pa_log_debug("xrdp_drift_update: %llu ms gap, estimate restarted",
+                     (unsigned long long) ((now - d->last) / PA_USEC_PER_MSEC));
+        xrdp_drift_reset(d);
+        d->ratio = ratio;
+    }
+    if (d->t0 == 0) {
+        d->t0 = now;
+    }
+
+    /* the fit is of frames received before this arrival against time,
+     * so a steady stream gives a line through the origin */
+    t = (double) (now - d->t0) / PA_USEC_PER_SEC;
+    decay = d->last ? exp2(-(double) (now - d->last) / PA_USEC_PER_SEC / HALF_LIFE_SEC) : 1.0;
+    d->sw = d->sw * decay + 1;
+    d->st = d->st * decay + t;
+    d->sf = d->sf * decay + d->frames;
+    d->stt = d->stt * decay + t * t;
+    d->stf = d->stf * decay + t * d->frames;
+    d->frames += frames;
+    d->last = now;
+
+    if ((target = target_ratio(d)) == 0) {
+        return;
+    }
+    step = SLEW_PER_SEC * frames / d->ss.rate;
+    d->ratio += PA_CLAMP(target - d->ratio, -step, step);
+}
+
+int xrdp_drift_ppm(const struct xrdp_drift *d) {
+    return (int) lrint((1.0 / d->ratio - 1.0) * 1e6);
+}
+
+size_t xrdp_drift_out_bytes(const struct xrdp_drift *d, size_t bytes) {
+    size_t frames = bytes / pa_frame_size(&d->ss);
+
+    return ((size_t) (frames * d->ratio) + 2) * pa_frame_size(&d->ss);
+}
+
+static float get(const struct xrdp_drift *d, const void *src, size_t i) {
+    if (d->ss.format == PA_SAMPLE_S16NE) {
+        return ((const int16_t *) src)[i];
+    }
+    return ((const float *) src)[i];
+}
+
+size_t xrdp_drift_run(struct xrdp_drift *d, void *dst, const void *src,
+                      size_t bytes) {
+    unsigned channels = d->ss.channels;
+    size_t frames = bytes / pa_frame_size(&d->ss);
+    double step = 1.0 / d->ratio;
+    size_t out = 0;
+    size_t i;
+    unsigned c;
+    double frac;
+
+    if (frames == 0) {
+        return 0;
+    }
+    if (!d->have_prev) {
+        /* nothing to interpolate from yet, start on the first frame */
+        for (c = 0; c < channels; c++) {
+            d->prev[c] = get(d, src, c);
+        }
+        d->pos = 1.0;
+        d->have_prev = 1;
+    }
+
+    /* pos counts from prev, frame i of src is at i + 1 */
+    while (d->pos < frames) {
+        i = (size_t) d->pos;
+        frac = d->pos - i;
+
+        for (c = 0; c < channels; c++) {
+            float a = i == 0 ? d->prev[c] : get(d, src, (i - 1) * channels + c);
+            float b = get(d, src, i * channels + c);
+            float v = a + (float) frac * (b - a);
+
+            if (d->ss.format == PA_SAMPLE_S16NE) {
+                ((int16_t *) dst)[out * channels + c] = (int16_t) lrintf(v);
+            } else {
+                ((float *) dst)[out * channels + c] = v;
+            }
+        }
+        out++;
+        d->pos += step;
+    }
+
+    d->pos -= frames;
+    for (c = 0; c < channels; c++) {
+        d->prev[c] = get(d, src, (frames - 1) * channels + c);
+    }
+    return out * pa_frame_size(&d->ss);
+}
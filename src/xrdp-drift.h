@@ -0,0 +1,77 @@
+/***
+  capture clock drift compensation for the xrdp source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_DRIFT_H
+#define XRDP_DRIFT_H
+
+#include <stddef.h>
+
+#include <pulse/sample.h>
+
+/* the estimate needs this much history before it is used */
+#define XRDP_DRIFT_MIN_SPAN_USEC (20 * PA_USEC_PER_SEC)
+/* arrivals further apart than this start the estimate over */
+#define XRDP_DRIFT_GAP_USEC (2 * PA_USEC_PER_SEC)
+/* corrections beyond this are clock trouble, not drift */
+#define XRDP_DRIFT_MAX_PPM 5000
+
+/*
+ * Estimates the rate the client's capture clock runs at against
+ * pa_rtclock_now() and resamples by the inverse, so the audio posted
+ * to the source runs at the local clock and long captures don't creep.
+ *
+ * The estimate is an exponentially weighted least squares fit of frames
+ * received over local time, so bursty arrivals average out. The ratio
+ * the resampler uses only moves towards it slowly, a step would be
+ * audible. The resampler interpolates linearly, good enough for
+ * corrections of a few hundred ppm, and handles S16NE and FLOAT32NE.
+ */
+struct xrdp_drift {
+    pa_sample_spec ss;
+
+    /* estimator, times in seconds since t0 */
+    pa_usec_t t0;
+    pa_usec_t last;
+    double sw, st, sf, stt, stf;
+    double frames;
+
+    double ratio; /* output frames per input frame */
+    double pos; /* input position of the next output frame, see run */
+    float prev[PA_CHANNELS_MAX]; /* last input frame of the previous run */
+    int have_prev;
+};
+
+/* returns -1 if the format is not supported */
+int xrdp_drift_init(struct xrdp_drift *d, const pa_sample_spec *ss);
+/* forget the estimate, for when the stream stops */
+void xrdp_drift_reset(struct xrdp_drift *d);
+/* 'frames' arrived at 'now' */
+void xrdp_drift_update(struct xrdp_drift *d, pa_usec_t now, size_t frames);
+/* correction in use, parts per million, positive when the client is fast */
+int xrdp_drift_ppm(const struct xrdp_drift *d);
+
+/* most output xrdp_drift_run() can make from 'bytes' of input */
+size_t xrdp_drift_out_bytes(const struct xrdp_drift *d, size_t bytes);
+/* resample 'bytes' of src into dst, returns the bytes written */
+size_t xrdp_drift_run(struct xrdp_drift *d, void *dst, const void *src,
+                      size_t bytes);
+
+#endif
@@ -0,0 +1,190 @@
+/***
+  capture jitter buffer with packet loss concealment
+
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/macro.h>
+
+#include "xrdp-jitter.h"
+
+int xrdp_jitter_init(struct xrdp_jitter *j, const pa_sample_spec *ss,
+                     size_t block, size_t target, size_t max_conceal) {
+    memset(j, 0, sizeof(*j));
+    if (ss->format != PA_SAMPLE_S16NE && ss->format != PA_SAMPLE_FLOAT32NE) {
+        return -1;
+    }
+    j->ss = *ss;
+    j->frame_size = pa_frame_size(ss);
+    j->block = MAX(block - block % j->frame_size, j->frame_size);
+    j->target = MAX(target - target % j->frame_size, j->block);
+    j->max_conceal = max_conceal - max_conceal % j->frame_size;
+    j->idle = pa_usec_to_bytes(XRDP_JITTER_IDLE_USEC, ss);
+    j->size = 2 * j->target;
+    j->buf = pa_xmalloc(j->size);
+    j->last = pa_xmalloc(j->block);
+    return 0;
+}
+
+void xrdp_jitter_done(struct xrdp_jitter *j) {
+    pa_xfree(j->buf);
+    j->buf = NULL;
+    pa_xfree(j->last);
+    j->last = NULL;
+}
+
+void xrdp_jitter_reset(struct xrdp_jitter *j) {
+    j->head = 0;
+    j->len = 0;
+    j->have_last = 0;
+    j->playing = 0;
+    j->in_gap = 0;
+    j->concealed = 0;
+    j->gap = 0;
+}
+
+static void ring_write(struct xrdp_jitter *j, const char *src, size_t bytes) {
+    size_t tail = (j->head + j->len) % j->size;
+    size_t part = MIN(bytes, j->size - tail);
+
+    memcpy(j->buf + tail, src, part);
+    memcpy(j->buf, src + part, bytes - part);
+    j->len += bytes;
+}
+
+static void ring_read(struct xrdp_jitter *j, char *dst, size_t bytes) {
+    size_t part = MIN(bytes, j->size - j->head);
+
+    memcpy(dst, j->buf + j->head, part);
+    memcpy(dst + part, j->buf, bytes - part);
+    j->head = (j->head + bytes) % j->size;
+    j->len -= bytes;
+}
+
+/* frame 'i' of dst is frame 'k' of src times 'gain', may be in place */
+static void scale_frame(const struct xrdp_jitter *j, void *dst, size_t i,
+                        const void *src, size_t k, float gain) {
+    unsigned channels = j->ss.channels;
+    unsigned c;
+
+    for (c = 0; c < channels; c++) {
+        if (j->ss.format == PA_SAMPLE_S16NE) {
+            ((int16_t *) dst)[i * channels + c] =
+                (int16_t) lrintf(((const int16_t *) src)[k * channels + c] * gain);
+        } else {
+            ((float *) dst)[i * channels + c] =
+                ((const float *) src)[k * channels + c] * gain;
+        }
+    }
+}
+
+/* one block of the last block repeated, fading to silence */
+static void conceal(struct xrdp_jitter *j, char *dst) {
+    size_t frames = j->block / j->frame_size;
+    size_t i;
+
+    memset(dst, 0, j->block);
+    if (!j->have_last) {
+        return;
+    }
+    for (i = 0; i < frames && j->concealed < j->max_conceal; i++) {
+        float gain = 1.0f - (float) j->concealed / j->max_conceal;
+
+        scale_frame(j, dst, i, j->last, (j->concealed / j->frame_size) % frames, gain);
+        j->concealed += j->frame_size;
+        j->concealed_frames++;
+    }
+}
+
+void xrdp_jitter_push(struct xrdp_jitter *j, const void *src, size_t bytes) {
+    size_t drop;
+
+    bytes -= bytes % j->frame_size;
+    if (j->len + bytes > j->size) {
+        /* a burst after a stall, keep the newest target worth */
+        drop = j->len + bytes - j->target;
+        j->overflows++;
+        if (drop >= j->len) {
+            src = (const char *) src + (drop - j->len);
+            bytes -= drop - j->len;
+            j->head = 0;
+            j->len = 0;
+        } else {
+            j->head = (j->head + drop) % j->size;
+            j->len -= drop;
+        }
+    }
+    ring_write(j, src, bytes);
+}
+
+size_t xrdp_jitter_pull(struct xrdp_jitter *j, void *dst) {
+    size_t frames = j->block / j->frame_size;
+    size_t i;
+
+    if (!j->playing) {
+        if (j->len < j->target) {
+            return 0;
+        }
+        j->playing = 1;
+    }
+
+    if (j->in_gap && j->len >= j->target) {
+        /* back from a gap, fade in so the edge doesn't click */
+        ring_read(j, dst, j->block);
+        for (i = 0; i < frames; i++) {
+            scale_frame(j, dst, i, dst, i, (float) (i + 1) / frames);
+        }
+        j->in_gap = 0;
+    } else if (!j->in_gap && j->len >= j->block) {
+        ring_read(j, dst, j->block);
+    } else {
+        if (!j->in_gap) {
+            j->in_gap = 1;
+            j->concealed = 0;
+            j->gap = 0;
+            j->concealments++;
+        } else if (j->gap >= j->idle) {
+            /* still in_gap, the next start fades in */
+            j->playing = 0;
+            j->have_last = 0;
+            return 0;
+        }
+        conceal(j, dst);
+        j->gap += j->block;
+        return j->block;
+    }
+
+    memcpy(j->last, dst, j->block);
+    j->have_last = 1;
+    return j->block;
+}
+
+size_t xrdp_jitter_fill(const struct xrdp_jitter *j) {
+    return j->len;
+}
@@ -0,0 +1,90 @@
+/***
+  capture jitter buffer with packet loss concealment
+
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_JITTER_H
+#define XRDP_JITTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pulse/sample.h>
+
+/* a gap this long means the client stopped, output ends until the
+ * target is reached again */
+#define XRDP_JITTER_IDLE_USEC PA_USEC_PER_SEC
+
+/*
+ * Collects captured audio up to a target depth and hands it out a block
+ * at a time on the local clock, so bursts from the client come out as a
+ * steady stream.
+ *
+ * When a block is not there in time the last one is repeated and faded
+ * out over up to max_conceal bytes, after that the gap is silence.
+ * Output resumes with a fade in once the target depth is back, or
+ * stops after XRDP_JITTER_IDLE_USEC. Data
+ * beyond twice the target is dropped, oldest first, down to the target.
+ * Handles S16NE and FLOAT32NE.
+ */
+struct xrdp_jitter {
+    pa_sample_spec ss;
+    size_t frame_size;
+    size_t block; /* bytes per xrdp_jitter_pull() */
+    size_t target; /* depth to collect before releasing */
+    size_t max_conceal; /* longest repeat in a gap */
+    size_t idle; /* XRDP_JITTER_IDLE_USEC in bytes */
+
+    char *buf; /* ring */
+    size_t size;
+    size_t head;
+    size_t len;
+
+    char *last; /* last block released from the ring */
+    int have_last;
+    int playing; /* 0 until the target is reached the first time */
+    int in_gap; /* concealing or silent, waiting for the target again */
+    size_t concealed; /* bytes repeated in the current gap */
+    size_t gap; /* bytes released in the current gap */
+
+    uint64_t concealments; /* gaps started */
+    uint64_t concealed_frames; /* frames repeated, not counting silence */
+    uint64_t overflows; /* times old data was dropped */
+};
+
+/* 'block' and 'target' in bytes of 'ss', returns -1 if the format is
+ * not supported */
+int xrdp_jitter_init(struct xrdp_jitter *j, const pa_sample_spec *ss,
+                     size_t block, size_t target, size_t max_conceal);
+/* also fine on a zeroed struct that was never set up */
+void xrdp_jitter_done(struct xrdp_jitter *j);
+/* drop what is buffered and wait for the target again, for when the
+ * stream stops */
+void xrdp_jitter_reset(struct xrdp_jitter *j);
+
+void xrdp_jitter_push(struct xrdp_jitter *j, const void *src, size_t bytes);
+/* writes one block into dst and returns its size, or 0 while there is
+ * nothing to release: before the target is reached the first time and
+ * after a gap went on for XRDP_JITTER_IDLE_USEC */
+size_t xrdp_jitter_pull(struct xrdp_jitter *j, void *dst);
+/* bytes waiting */
+size_t xrdp_jitter_fill(const struct xrdp_jitter *j);
+
+#endif
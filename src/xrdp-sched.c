@@ -0,0 +1,218 @@
+/***
+  IO thread scheduling for the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <pulse/version.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-sched.h"
+
+#ifdef __linux__
+/* "0-3,8" style list, returns -1 if it does not parse */
+static int parse_cpus(const char *list, cpu_set_t *cpus) {
+    const char *p = list;
+    char *end;
+    unsigned long first;
+    unsigned long last;
+
+    CPU_ZERO(cpus);
+    while (*p) {
+        first = strtoul(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, cpus);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+static void format_cpus(const cpu_set_t *cpus, char *buf, size_t size) {
+    size_t len = 0;
+    int first;
+    int i;
+
+    buf[0] = 0;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, cpus)) {
+            continue;
+        }
+        first = i;
+        while (i + 1 < CPU_SETSIZE && CPU_ISSET(i + 1, cpus)) {
+            i++;
+        }
+        if (first == i) {
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "",
+                            first, i);
+        }
+        if (len >= size) {
+            /* cut short, mark it */
+            pa_strlcpy(buf + size - 4, "...", 4);
+            return;
+        }
+    }
+}
+#endif
+
+int xrdp_sched_parse(struct xrdp_sched *s, pa_modargs *ma, pa_core *core) {
+    const char *policy;
+    const char *cpus;
+    uint32_t priority;
+
+    memset(s, 0, sizeof(*s));
+    policy = pa_modargs_get_value(ma, "sched", "inherit");
+    if (strcmp(policy, "inherit") == 0) {
+        s->policy = XRDP_SCHED_INHERIT;
+    } else if (strcmp(policy, "rtkit") == 0) {
+        s->policy = XRDP_SCHED_RTKIT;
+    } else if (strcmp(policy, "fifo") == 0) {
+        s->policy = XRDP_SCHED_FIFO;
+    } else if (strcmp(policy, "rr") == 0) {
+        s->policy = XRDP_SCHED_RR;
+    } else {
+        pa_log("Invalid sched '%s', expected inherit, rtkit, fifo or rr", policy);
+        return -1;
+    }
+
+    /* the same default as realtime-priority in daemon.conf */
+    priority = core->realtime_priority;
+    if (pa_modargs_get_value_u32(ma, "sched_priority", &priority) < 0 ||
+        priority < 1 || priority > 99) {
+        pa_log("Failed to parse sched_priority value, expected 1 to 99.");
+        return -1;
+    }
+    s->priority = (int) priority;
+
+    cpus = pa_modargs_get_value(ma, "cpu_affinity", NULL);
+    if (cpus) {
+#ifdef __linux__
+        if (parse_cpus(cpus, &s->cpus) != 0) {
+            pa_log("Invalid cpu_affinity '%s', expected a list like 0-3,8", cpus);
+            return -1;
+        }
+        s->pin = 1;
+#else
+        pa_log_warn("cpu_affinity is only supported on Linux, ignored");
+#endif
+    }
+    return 0;
+}
+
+void xrdp_sched_apply(const struct xrdp_sched *s,
+                      struct xrdp_transport_stats *stats) {
+    struct sched_param param;
+    int policy;
+    int err;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+
+    switch (s->policy) {
+        case XRDP_SCHED_INHERIT:
+            break;
+
+        case XRDP_SCHED_RTKIT:
+#if defined(PA_CHECK_VERSION) && PA_CHECK_VERSION(1, 0, 0)
+            if (pa_thread_make_realtime(s->priority) != 0) {
+#else
+            if (pa_make_realtime(s->priority) != 0) {
+#endif
+                pa_log_warn("Failed to get realtime priority %d", s->priority);
+            }
+            break;
+
+        case XRDP_SCHED_FIFO:
+        case XRDP_SCHED_RR:
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = s->priority;
+            policy = s->policy == XRDP_SCHED_FIFO ? SCHED_FIFO : SCHED_RR;
+#ifdef SCHED_RESET_ON_FORK
+            /* like pa_thread_make_realtime(), children don't get it */
+            policy |= SCHED_RESET_ON_FORK;
+#endif
+            if ((err = pthread_setschedparam(pthread_self(), policy, &param)) != 0) {
+                pa_log_warn("Failed to set %s priority %d: %s",
+                            s->policy == XRDP_SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR",
+                            s->priority, pa_cstrerror(err));
+            }
+            break;
+    }
+
+#ifdef __linux__
+    if (s->pin && (err = pthread_setaffinity_np(pthread_self(), sizeof(s->cpus),
+                                                &s->cpus)) != 0) {
+        pa_log_warn("Failed to set cpu_affinity: %s", pa_cstrerror(err));
+    }
+#endif
+
+    /* report what we got, not what was asked for */
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) {
+#ifdef SCHED_RESET_ON_FORK
+        policy &= ~SCHED_RESET_ON_FORK;
+#endif
+        pa_strlcpy(stats->sched_policy,
+                   policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : "other",
+                   sizeof(stats->sched_policy));
+        stats->sched_priority = param.sched_priority;
+    }
+#ifdef __linux__
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+        format_cpus(&cpus, stats->sched_cpus, sizeof(stats->sched_cpus));
+    }
+#endif
+    pa_log_info("IO thread scheduling %s priority %d cpus %s",
+                stats->sched_policy, stats->sched_priority, stats->sched_cpus);
+}
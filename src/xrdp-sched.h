@@ -0,0 +1,58 @@
+/***
+  IO thread scheduling for the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_SCHED_H
+#define XRDP_SCHED_H
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <pulsecore/core.h>
+#include <pulsecore/modargs.h>
+
+#include "xrdp-transport.h"
+
+enum xrdp_sched_policy {
+    XRDP_SCHED_INHERIT, /* whatever the daemon thread had */
+    XRDP_SCHED_RTKIT, /* pa_thread_make_realtime(), rtkit first */
+    XRDP_SCHED_FIFO,
+    XRDP_SCHED_RR
+};
+
+/* the sched=, sched_priority= and cpu_affinity= modargs */
+struct xrdp_sched {
+    enum xrdp_sched_policy policy;
+    int priority;
+#ifdef __linux__
+    int pin; /* cpus is set */
+    cpu_set_t cpus;
+#endif
+};
+
+/* returns -1 after logging if the modargs are bad */
+int xrdp_sched_parse(struct xrdp_sched *s, pa_modargs *ma, pa_core *core);
+/* call from the IO thread, failures are logged and not fatal. Fills in
+ * the sched_* fields of stats with what the thread got */
+void xrdp_sched_apply(const struct xrdp_sched *s,
+                      struct xrdp_transport_stats *stats);
+
+#endif
@@ -0,0 +1,215 @@
+/***
+  shared memory audio transport for xrdp
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#ifdef HAVE_MEMFD
+#include <pulsecore/memfd-wrappers.h>
+#endif
+
+#include "xrdp-shm.h"
+
+static void shm_reset(struct xrdp_shm *shm) {
+    pa_atomic_store(&shm->hdr->write_pos, 0);
+    pa_atomic_store(&shm->hdr->read_pos, 0);
+}
+
+int xrdp_shm_create(struct xrdp_shm *shm, const char *name, size_t min_data_size) {
+#ifdef HAVE_MEMFD
+    size_t data_size;
+    size_t page_size;
+    size_t data_offset;
+    void *map;
+    int fd;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->name = name;
+    shm->fd = -1;
+
+    data_size = 4096;
+    while (data_size < min_data_size) {
+        data_size *= 2;
+    }
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    data_offset = page_size;
+
+    fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0) {
+        pa_log("xrdp_shm_create: memfd_create failed: %s", pa_cstrerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, data_offset + data_size) != 0) {
+        pa_log("xrdp_shm_create: ftruncate failed: %s", pa_cstrerror(errno));
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, data_offset + data_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        pa_log("xrdp_shm_create: mmap failed: %s", pa_cstrerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    shm->fd = fd;
+    shm->map_size = data_offset + data_size;
+    shm->hdr = map;
+    shm->data = (char *) map + data_offset;
+
+    shm->hdr->magic = XRDP_SHM_MAGIC;
+    shm->hdr->version = XRDP_SHM_VERSION;
+    shm->hdr->data_offset = data_offset;
+    shm->hdr->data_size = data_size;
+    shm_reset(shm);
+
+    return 0;
+#else
+    (void) name;
+    (void) min_data_size;
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+    pa_log("xrdp_shm_create: built without memfd support");
+    return -1;
+#endif
+}
+
+void xrdp_shm_destroy(struct xrdp_shm *shm) {
+    if (shm->hdr) {
+        munmap(shm->hdr, shm->map_size);
+        shm->hdr = NULL;
+        shm->data = NULL;
+    }
+    if (shm->fd >= 0) {
+        close(shm->fd);
+        shm->fd = -1;
+    }
+}
+
+int xrdp_shm_renew(struct xrdp_shm *shm) {
+    struct xrdp_shm fresh;
+
+    if (xrdp_shm_create(&fresh, shm->name, shm->hdr->data_size) != 0) {
+        return -1;
+    }
+    xrdp_shm_destroy(shm);
+    *shm = fresh;
+    return 0;
+}
+
+size_t xrdp_shm_readable(struct xrdp_shm *shm) {
+    uint32_t w = (uint32_t) pa_atomic_load(&shm->hdr->write_pos);
+    uint32_t r = (uint32_t) pa_atomic_load(&shm->hdr->read_pos);
+
+    return w - r;
+}
+
+size_t xrdp_shm_writable(struct xrdp_shm *shm) {
+    return shm->hdr->data_size - xrdp_shm_readable(shm);
+}
+
+size_t xrdp_shm_write(struct xrdp_shm *shm, const void *data, size_t bytes) {
+    uint32_t w = (uint32_t) pa_atomic_load(&shm->hdr->write_pos);
+    uint32_t mask = shm->hdr->data_size - 1;
+    size_t offset;
+    size_t part;
+
+    bytes = MIN(bytes, xrdp_shm_writable(shm));
+    offset = w & mask;
+    part = MIN(bytes, shm->hdr->data_size - offset);
+    memcpy(shm->data + offset, data, part);
+    memcpy(shm->data, (const char *) data + part, bytes - part);
+
+    /* pa_atomic_store() is a full barrier, the data is visible first */
+    pa_atomic_store(&shm->hdr->write_pos, (int) (w + bytes));
+
+    return bytes;
+}
+
+size_t xrdp_shm_read(struct xrdp_shm *shm, void *data, size_t bytes) {
+    uint32_t r = (uint32_t) pa_atomic_load(&shm->hdr->read_pos);
+    uint32_t mask = shm->hdr->data_size - 1;
+    size_t offset;
+    size_t part;
+
+    bytes = MIN(bytes, xrdp_shm_readable(shm));
+    offset = r & mask;
+    part = MIN(bytes, shm->hdr->data_size - offset);
+    memcpy(data, shm->data + offset, part);
+    memcpy((char *) data + part, shm->data, bytes - part);
+
+    pa_atomic_store(&shm->hdr->read_pos, (int) (r + bytes));
+
+    return bytes;
+}
+
+int xrdp_shm_send_fd(int sock, int fd, const void *msg, size_t bytes) {
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t sent;
+
+    memset(&mh, 0, sizeof(mh));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void *) msg;
+    iov.iov_len = bytes;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+        sent = sendmsg(sock, &mh, 0);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent != (ssize_t) bytes) {
+        pa_log("xrdp_shm_send_fd: sendmsg failed: %s",
+               sent < 0 ? pa_cstrerror(errno) : "short write");
+        return -1;
+    }
+
+    return 0;
+}
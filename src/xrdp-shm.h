@@ -0,0 +1,80 @@
+/***
+  shared memory audio transport for xrdp
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_SHM_H
+#define XRDP_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pulsecore/atomic.h>
+
+/*
+ * A memfd holding one single producer / single consumer byte ring. The
+ * fd is passed to chansrv with SCM_RIGHTS once per connection, after
+ * that the socket only carries wakeups. Every connection gets a fresh
+ * memfd, a previous chansrv that still has the old one mapped can't
+ * touch the new ring.
+ *
+ * Both positions run freely and wrap at 2^32, data_size is a power of
+ * two. The producer copies data in, then publishes write_pos; the
+ * consumer copies data out, then publishes read_pos. The producer only
+ * sends a wakeup when it finds the ring empty, so a consumer has to
+ * check write_pos again after publishing read_pos before it sleeps.
+ */
+
+#define XRDP_SHM_MAGIC 0x52534d78 /* "xMSR" */
+#define XRDP_SHM_VERSION 1
+
+struct xrdp_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t data_offset; /* from the start of the mapping */
+    uint32_t data_size;
+    pa_atomic_t write_pos;
+    pa_atomic_t read_pos;
+};
+
+struct xrdp_shm {
+    const char *name; /* as given to xrdp_shm_create() */
+    int fd;
+    size_t map_size;
+    struct xrdp_shm_header *hdr;
+    char *data;
+};
+
+/* returns 0 on success, -1 if memfd is not available or setup failed */
+int xrdp_shm_create(struct xrdp_shm *shm, const char *name, size_t min_data_size);
+void xrdp_shm_destroy(struct xrdp_shm *shm);
+/* replace the memfd with a new empty one of the same size, for a new
+ * connection. On failure the old one is kept and -1 returned */
+int xrdp_shm_renew(struct xrdp_shm *shm);
+
+size_t xrdp_shm_readable(struct xrdp_shm *shm);
+size_t xrdp_shm_writable(struct xrdp_shm *shm);
+/* copy up to 'bytes' in or out, returns the number of bytes copied */
+size_t xrdp_shm_write(struct xrdp_shm *shm, const void *data, size_t bytes);
+size_t xrdp_shm_read(struct xrdp_shm *shm, void *data, size_t bytes);
+
+/* send 'msg' on 'sock' with 'fd' attached, returns 0 if all of it went */
+int xrdp_shm_send_fd(int sock, int fd, const void *msg, size_t bytes);
+
+#endif
@@ -0,0 +1,65 @@
+/***
+  IO thread state the main thread reads without a message
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <sched.h>
+
+#include "xrdp-snapshot.h"
+
+void xrdp_snapshot_write(struct xrdp_snapshot *s,
+                         const struct xrdp_snapshot_data *d) {
+    pa_atomic_inc(&s->seq);
+    __sync_synchronize();
+    memcpy(&s->data, d, sizeof(*d));
+    __sync_synchronize();
+    pa_atomic_inc(&s->seq);
+}
+
+void xrdp_snapshot_read(struct xrdp_snapshot *s, struct xrdp_snapshot_data *d) {
+    int seq;
+
+    for (;;) {
+        seq = pa_atomic_load(&s->seq);
+        if (seq & 1) {
+            /* a write takes a memcpy, let it finish */
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        memcpy(d, &s->data, sizeof(*d));
+        __sync_synchronize();
+        if (pa_atomic_load(&s->seq) == seq) {
+            return;
+        }
+    }
+}
+
+pa_usec_t xrdp_snapshot_latency(const struct xrdp_snapshot_data *d,
+                                pa_usec_t now) {
+    /* rendered ahead of now plus what sits downstream, a source is
+     * never ahead */
+    return (d->timestamp > now ? d->timestamp - now : 0) + d->downstream_usec;
+}
@@ -0,0 +1,64 @@
+/***
+  IO thread state the main thread reads without a message
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_SNAPSHOT_H
+#define XRDP_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include <pulse/sample.h>
+#include <pulsecore/atomic.h>
+
+#include "xrdp-transport.h"
+
+/*
+ * A seqlock: the IO thread is the only writer and never waits, the main
+ * thread copies the data out and retries if a write overlapped. The
+ * main thread gets latency and counters from here on its own timer
+ * instead of the IO thread posting them.
+ */
+
+struct xrdp_snapshot_data {
+    pa_usec_t time; /* pa_rtclock_now() of the write */
+    pa_usec_t timestamp; /* render or capture clock */
+    pa_usec_t downstream_usec; /* queued past the clock, chansrv side for
+                                * the sink, jitter buffer for the source */
+    uint64_t queued_bytes; /* in our send ring, not yet written */
+    uint64_t chansrv_queued_bytes; /* last amount chansrv reported, sink only */
+    struct xrdp_transport_stats stats;
+};
+
+struct xrdp_snapshot {
+    pa_atomic_t seq; /* odd while a write is in progress */
+    struct xrdp_snapshot_data data;
+};
+
+/* IO thread */
+void xrdp_snapshot_write(struct xrdp_snapshot *s,
+                         const struct xrdp_snapshot_data *d);
+/* any other thread */
+void xrdp_snapshot_read(struct xrdp_snapshot *s, struct xrdp_snapshot_data *d);
+
+/* latency the snapshot gives at 'now', what GET_LATENCY would say */
+pa_usec_t xrdp_snapshot_latency(const struct xrdp_snapshot_data *d,
+                                pa_usec_t now);
+
+#endif
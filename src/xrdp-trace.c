@@ -0,0 +1,103 @@
+/***
+  hot path event trace for the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-trace.h"
+
+void xrdp_trace_init(struct xrdp_trace *t, const char *path) {
+    memset(t, 0, sizeof(*t));
+    if (path == NULL) {
+        return;
+    }
+#ifdef XRDP_HOTPATH_TRACE
+    t->events = pa_xnew0(struct xrdp_trace_event, XRDP_TRACE_EVENTS);
+    t->path = pa_xstrdup(path);
+#else
+    pa_log_warn("trace_file=%s ignored, built without --enable-hotpath-trace",
+                path);
+#endif
+}
+
+void xrdp_trace_done(struct xrdp_trace *t) {
+    pa_xfree(t->events);
+    t->events = NULL;
+    pa_xfree(t->path);
+    t->path = NULL;
+}
+
+void xrdp_trace_add(struct xrdp_trace *t, uint32_t code, uint64_t bytes) {
+    struct xrdp_trace_event *ev;
+
+    if (t->events == NULL) {
+        return;
+    }
+    ev = &t->events[t->next % XRDP_TRACE_EVENTS];
+    ev->usec = pa_rtclock_now();
+    ev->code = code;
+    ev->bytes = (uint32_t) MIN(bytes, (uint64_t) UINT32_MAX);
+    t->next++;
+}
+
+void xrdp_trace_dump(struct xrdp_trace *t) {
+    FILE *f;
+    uint32_t count;
+    uint32_t first;
+    uint32_t i;
+
+    if (t->events == NULL || t->next == 0) {
+        return;
+    }
+    if ((f = fopen(t->path, "wb")) == NULL) {
+        pa_log("xrdp_trace_dump: can't open %s: %s", t->path,
+               pa_cstrerror(errno));
+        return;
+    }
+    count = MIN(t->next, (uint32_t) XRDP_TRACE_EVENTS);
+    first = t->next - count;
+    fwrite("XRDPTRC1", 1, 8, f);
+    fwrite(&count, sizeof(count), 1, f);
+    for (i = 0; i < count; i++) {
+        fwrite(&t->events[(first + i) % XRDP_TRACE_EVENTS],
+               sizeof(struct xrdp_trace_event), 1, f);
+    }
+    if (fclose(f) != 0) {
+        pa_log("xrdp_trace_dump: writing %s failed: %s", t->path,
+               pa_cstrerror(errno));
+        return;
+    }
+    pa_log_info("xrdp_trace_dump: wrote %u events to %s",
+                (unsigned int) count, t->path);
+}
@@ -0,0 +1,81 @@
+/***
+  hot path event trace for the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_TRACE_H
+#define XRDP_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Per-chunk events don't go through pa_log, not even pa_log_debug. With
+ * --enable-hotpath-trace XRDP_TRACE() appends a fixed size record to a
+ * ring owned by the IO thread, which xrdp_trace_dump() writes out to the
+ * trace_file= given to the module. Other builds compile XRDP_TRACE() out,
+ * arguments included.
+ *
+ * The dump is "XRDPTRC1", a uint32 event count and that many events,
+ * oldest first, all in host byte order.
+ */
+
+enum xrdp_trace_code {
+    XRDP_TRACE_RENDER = 1, /* bytes rendered */
+    XRDP_TRACE_SEND, /* bytes handed to the socket or shm ring */
+    XRDP_TRACE_DROP, /* bytes dropped, ring full */
+    XRDP_TRACE_LATENCY, /* GET_LATENCY answered, bytes is the usec */
+    XRDP_TRACE_REWIND, /* bytes rewound */
+    XRDP_TRACE_FEEDBACK, /* chansrv queue depth in bytes */
+    XRDP_TRACE_CAPTURE, /* bytes posted by the source */
+    XRDP_TRACE_WAKEUP, /* timer wakeup, bytes is the lateness in usec */
+    XRDP_TRACE_MSG /* other message, bytes is the code */
+};
+
+struct xrdp_trace_event {
+    uint64_t usec; /* pa_rtclock_now() */
+    uint32_t code;
+    uint32_t bytes;
+};
+
+/* events kept, older ones are overwritten */
+#define XRDP_TRACE_EVENTS 4096
+
+struct xrdp_trace {
+    struct xrdp_trace_event *events; /* NULL unless tracing */
+    char *path;
+    uint32_t next; /* total events added */
+};
+
+/* warns when path is given to a build without tracing */
+void xrdp_trace_init(struct xrdp_trace *t, const char *path);
+/* also fine on a zeroed struct that was never set up */
+void xrdp_trace_done(struct xrdp_trace *t);
+void xrdp_trace_add(struct xrdp_trace *t, uint32_t code, uint64_t bytes);
+/* write the ring to the trace file, from the IO thread or after it
+ * stopped */
+void xrdp_trace_dump(struct xrdp_trace *t);
+
+#ifdef XRDP_HOTPATH_TRACE
+#define XRDP_TRACE(t, code, bytes) xrdp_trace_add((t), (code), (bytes))
+#else
+/* sizeof keeps variables only traced from warning, nothing is evaluated */
+#define XRDP_TRACE(t, code, bytes) do { (void) sizeof(bytes); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,323 @@
+/***
+  socket transport shared by the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+// config.h from pulseaudio sources
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-error.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "xrdp-transport.h"
+
+void xrdp_send_ring_init(struct xrdp_send_ring *r, size_t size) {
+    r->buf = pa_xmalloc(size);
+    r->size = size;
+    r->head = 0;
+    r->len = 0;
+}
+
+void xrdp_send_ring_done(struct xrdp_send_ring *r) {
+    pa_xfree(r->buf);
+    r->buf = NULL;
+    r->size = 0;
+    r->head = 0;
+    r->len = 0;
+}
+
+size_t xrdp_send_ring_space(const struct xrdp_send_ring *r) {
+    return r->size - r->len;
+}
+
+void xrdp_send_ring_write(struct xrdp_send_ring *r, const char *data, size_t bytes) {
+    size_t tail;
+    size_t part;
+
+    pa_assert(bytes <= xrdp_send_ring_space(r));
+
+    tail = (r->head + r->len) % r->size;
+    part = MIN(bytes, r->size - tail);
+    memcpy(r->buf + tail, data, part);
+    memcpy(r->buf, data + part, bytes - part);
+    r->len += bytes;
+}
+
+void xrdp_send_ring_consume(struct xrdp_send_ring *r, size_t bytes) {
+    pa_assert(bytes <= r->len);
+
+    r->head = (r->head + bytes) % r->size;
+    r->len -= bytes;
+    if (r->len == 0) {
+        r->head = 0;
+    }
+}
+
+void xrdp_send_ring_unwrite(struct xrdp_send_ring *r, size_t bytes) {
+    pa_assert(bytes <= r->len);
+
+    r->len -= bytes;
+    if (r->len == 0) {
+        r->head = 0;
+    }
+}
+
+void xrdp_send_ring_read(struct xrdp_send_ring *r, char *data, size_t bytes) {
+    size_t part;
+
+    pa_assert(bytes <= r->len);
+
+    part = MIN(bytes, r->size - r->head);
+    memcpy(data, r->buf + r->head, part);
+    memcpy(data + part, r->buf, bytes - part);
+    xrdp_send_ring_consume(r, bytes);
+}
+
+/* queue what sendmsg() did not take, skipping the first 'skip' bytes */
+static void send_ring_write_frames(struct xrdp_send_ring *r,
+                                   struct xrdp_send_frame *frames,
+                                   int nframes, size_t skip) {
+    size_t part;
+    int i;
+
+    for (i = 0; i < nframes; i++) {
+        if (skip < sizeof(frames[i].h)) {
+            xrdp_send_ring_write(r, (char*)(&frames[i].h) + skip,
+                                 sizeof(frames[i].h) - skip);
+            skip = 0;
+        } else {
+            skip -= sizeof(frames[i].h);
+        }
+        part = MIN(skip, frames[i].bytes);
+        xrdp_send_ring_write(r, frames[i].data + part, frames[i].bytes - part);
+        skip -= part;
+    }
+}
+
+int xrdp_send_frames(int fd, struct xrdp_send_ring *r,
+                     struct xrdp_send_frame *frames, int nframes,
+                     struct xrdp_transport_stats *stats) {
+    struct iovec iov[2 + 2 * XRDP_SEND_MAX_FRAMES];
+    struct msghdr msg;
+    size_t queued;
+    size_t total;
+    size_t part;
+    ssize_t sent;
+    int niov;
+    int accepted;
+
+    pa_assert(nframes <= XRDP_SEND_MAX_FRAMES);
+
+    niov = 0;
+    if (r->len > 0) {
+        part = MIN(r->len, r->size - r->head);
+        iov[niov].iov_base = r->buf + r->head;
+        iov[niov].iov_len = part;
+        niov++;
+        if (part < r->len) {
+            iov[niov].iov_base = r->buf;
+            iov[niov].iov_len = r->len - part;
+            niov++;
+        }
+    }
+
+    /* worst case nothing gets sent, so only take frames the ring can hold */
+    queued = r->len;
+    total = r->len;
+    for (accepted = 0; accepted < nframes; accepted++) {
+        if (total + sizeof(frames[accepted].h) + frames[accepted].bytes > r->size) {
+            break;
+        }
+        total += sizeof(frames[accepted].h) + frames[accepted].bytes;
+        iov[niov].iov_base = &frames[accepted].h;
+        iov[niov].iov_len = sizeof(frames[accepted].h);
+        niov++;
+        if (frames[accepted].bytes > 0) {
+            iov[niov].iov_base = (void*) frames[accepted].data;
+            iov[niov].iov_len = frames[accepted].bytes;
+            niov++;
+        }
+    }
+    if (accepted < nframes) {
+        pa_log_debug("xrdp_send_frames: send buffer full, dropped %d frames",
+                     nframes - accepted);
+        stats->frames_dropped += nframes - accepted;
+    }
+
+    sent = 0;
+    if (niov > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        do {
+            sent = sendmsg(fd, &msg, 0);
+            stats->send_calls++;
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                pa_log("xrdp_send_frames: sendmsg failed: %s", pa_cstrerror(errno));
+                return -1;
+            }
+            stats->eagain++;
+            sent = 0;
+        }
+    }
+
+    if ((size_t) sent < total) {
+        stats->short_writes++;
+    }
+    stats->bytes_sent += sent;
+    stats->frames_sent += accepted;
+
+    if ((size_t) sent <= queued) {
+        xrdp_send_ring_consume(r, sent);
+        send_ring_write_frames(r, frames, accepted, 0);
+    } else {
+        xrdp_send_ring_consume(r, queued);
+        send_ring_write_frames(r, frames, accepted, sent - queued);
+    }
+
+    return accepted;
+}
+
+static const pa_usec_t xrdp_stats_jitter_bounds[XRDP_STATS_JITTER_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2000, 5000, 10000
+};
+
+void xrdp_stats_add_jitter(struct xrdp_transport_stats *stats, pa_usec_t late) {
+    int i;
+
+    for (i = 0; i < XRDP_STATS_JITTER_BUCKETS - 1; i++) {
+        if (late <= xrdp_stats_jitter_bounds[i]) {
+            break;
+        }
+    }
+    stats->jitter[i]++;
+}
+
+void xrdp_stats_add_process(struct xrdp_transport_stats *stats, pa_usec_t usec) {
+    if (usec > stats->max_process_usec) {
+        stats->max_process_usec = usec;
+    }
+}
+
+void xrdp_stats_to_proplist(const struct xrdp_transport_stats *stats,
+                            pa_proplist *pl) {
+    char key[64];
+    int i;
+
+#define XRDP_STATS_SET(name) \
+    pa_proplist_setf(pl, "xrdp.stats." #name, "%llu", \
+                     (unsigned long long) stats->name)
+    XRDP_STATS_SET(bytes_sent);
+    XRDP_STATS_SET(bytes_received);
+    XRDP_STATS_SET(frames_sent);
+    XRDP_STATS_SET(frames_received);
+    XRDP_STATS_SET(frames_dropped);
+    XRDP_STATS_SET(send_calls);
+    XRDP_STATS_SET(recv_calls);
+    XRDP_STATS_SET(short_writes);
+    XRDP_STATS_SET(eagain);
+    XRDP_STATS_SET(underruns);
+    XRDP_STATS_SET(max_process_usec);
+    XRDP_STATS_SET(jitter_buffer_usec);
+    XRDP_STATS_SET(concealments);
+    XRDP_STATS_SET(concealed_frames);
+    XRDP_STATS_SET(jitter_buffer_overflows);
+#undef XRDP_STATS_SET
+    pa_proplist_setf(pl, "xrdp.stats.reconnects", "%llu",
+                     (unsigned long long) (stats->connects > 0 ? stats->connects - 1 : 0));
+    pa_proplist_setf(pl, "xrdp.stats.drift_ppm", "%d", (int) stats->drift_ppm);
+
+    for (i = 0; i < XRDP_STATS_JITTER_BUCKETS; i++) {
+        if (i < XRDP_STATS_JITTER_BUCKETS - 1) {
+            snprintf(key, sizeof(key), "xrdp.stats.wakeup_jitter.le_%lluus",
+                     (unsigned long long) xrdp_stats_jitter_bounds[i]);
+        } else {
+            snprintf(key, sizeof(key), "xrdp.stats.wakeup_jitter.gt_%lluus",
+                     (unsigned long long) xrdp_stats_jitter_bounds[i - 1]);
+        }
+        pa_proplist_setf(pl, key, "%llu", (unsigned long long) stats->jitter[i]);
+    }
+
+    if (stats->sched_policy[0]) {
+        pa_proplist_sets(pl, "xrdp.sched.policy", stats->sched_policy);
+        pa_proplist_setf(pl, "xrdp.sched.priority", "%d", stats->sched_priority);
+        pa_proplist_sets(pl, "xrdp.sched.cpus", stats->sched_cpus);
+    }
+}
+
+size_t xrdp_socket_outq(int fd) {
+    int outq = 0;
+
+#if defined(SIOCOUTQ)
+    if (ioctl(fd, SIOCOUTQ, &outq) != 0) {
+        return 0;
+    }
+#elif defined(FIONWRITE)
+    if (ioctl(fd, FIONWRITE, &outq) != 0) {
+        return 0;
+    }
+#else
+    (void) fd;
+#endif
+    return outq > 0 ? (size_t) outq : 0;
+}
+
+int xrdp_lsend(int fd, const char *data, int bytes) {
+    int sent = 0;
+    int error;
+    while (sent < bytes) {
+        error = send(fd, data + sent, bytes - sent, 0);
+        if (error < 1) {
+            return error;
+        }
+        sent += error;
+    }
+    return sent;
+}
+
+int xrdp_lrecv(int fd, char *data, int bytes) {
+    int recved = 0;
+    int error;
+    while (recved < bytes) {
+        error = recv(fd, data + recved, bytes - recved, 0);
+        if (error < 1) {
+            return error;
+        }
+        recved += error;
+    }
+    return recved;
+}
@@ -0,0 +1,122 @@
+/***
+  socket transport shared by the xrdp sink and source
+
+  Copyright (C) 2013-2021 Jay Sorg, Neutrino Labs, and all contributors.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifndef XRDP_TRANSPORT_H
+#define XRDP_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pulse/proplist.h>
+#include <pulse/sample.h>
+
+/* most frames xrdp_send_frames() takes at once */
+#define XRDP_SEND_MAX_FRAMES 8
+
+/* frame header on the sink socket, bytes counts the header too */
+struct xrdp_header {
+    int code;
+    int bytes;
+};
+
+/* one frame on the wire, header followed by payload */
+struct xrdp_send_frame {
+    struct xrdp_header h;
+    const char *data;
+    size_t bytes;
+};
+
+/* bounded byte ring holding framed data the socket would not take yet */
+struct xrdp_send_ring {
+    char *buf;
+    size_t size;
+    size_t head; /* offset of the first queued byte */
+    size_t len;  /* number of queued bytes */
+};
+
+/* buckets of the timer wakeup lateness histogram, up to 100, 250 and
+ * 500 usec, 1, 2, 5 and 10 msec and later than that */
+#define XRDP_STATS_JITTER_BUCKETS 8
+
+/* counters kept in the IO thread, never reset while the module runs.
+ * Only the IO thread writes them, the main thread gets copies */
+struct xrdp_transport_stats {
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t frames_sent;
+    uint64_t frames_received;
+    uint64_t frames_dropped; /* did not fit in the send ring */
+    uint64_t send_calls;
+    uint64_t recv_calls;
+    uint64_t short_writes; /* the socket did not take everything */
+    uint64_t eagain; /* sendmsg() found the socket full */
+    uint64_t connects;
+    uint64_t underruns;
+    pa_usec_t max_process_usec; /* longest render-to-send or receive-to-post */
+    uint64_t jitter[XRDP_STATS_JITTER_BUCKETS];
+    int32_t drift_ppm; /* source resampling or sink pacing correction */
+
+    /* source jitter buffer, see xrdp-jitter.h */
+    pa_usec_t jitter_buffer_usec; /* fill level */
+    uint64_t concealments; /* gaps filled in */
+    uint64_t concealed_frames;
+    uint64_t jitter_buffer_overflows;
+
+    /* what the IO thread ended up with, see xrdp_sched_apply() */
+    char sched_policy[8]; /* "other", "fifo" or "rr", empty until known */
+    int sched_priority;
+    char sched_cpus[48]; /* like "0-3,8" */
+};
+
+void xrdp_send_ring_init(struct xrdp_send_ring *r, size_t size);
+void xrdp_send_ring_done(struct xrdp_send_ring *r);
+size_t xrdp_send_ring_space(const struct xrdp_send_ring *r);
+/* caller checks xrdp_send_ring_space() first, frames are never split */
+void xrdp_send_ring_write(struct xrdp_send_ring *r, const char *data, size_t bytes);
+void xrdp_send_ring_consume(struct xrdp_send_ring *r, size_t bytes);
+/* drop the newest 'bytes' again */
+void xrdp_send_ring_unwrite(struct xrdp_send_ring *r, size_t bytes);
+/* copy the oldest 'bytes' out and consume them */
+void xrdp_send_ring_read(struct xrdp_send_ring *r, char *data, size_t bytes);
+
+/* send anything queued in 'r' plus the given frames on the non-blocking
+ * 'fd' with one sendmsg() call, whatever the socket does not take is
+ * queued. Frames that would not fit in the ring are dropped whole.
+ * Returns the number of frames accepted or -1 if the connection failed */
+int xrdp_send_frames(int fd, struct xrdp_send_ring *r,
+                     struct xrdp_send_frame *frames, int nframes,
+                     struct xrdp_transport_stats *stats);
+
+void xrdp_stats_add_jitter(struct xrdp_transport_stats *stats, pa_usec_t late);
+void xrdp_stats_add_process(struct xrdp_transport_stats *stats, pa_usec_t usec);
+/* sets the xrdp.stats.* and xrdp.sched.* properties */
+void xrdp_stats_to_proplist(const struct xrdp_transport_stats *stats,
+                            pa_proplist *pl);
+
+/* bytes sitting in the kernel send buffer of a socket */
+size_t xrdp_socket_outq(int fd);
+
+/* blocking send and receive of exactly 'bytes', returns 'bytes' or what
+ * the failing send() or recv() call returned */
+int xrdp_lsend(int fd, const char *data, int bytes);
+int xrdp_lrecv(int fd, char *data, int bytes);
+
+#endif